@@ -26,12 +26,15 @@
 /* For asprintf */
 #define _GNU_SOURCE
 
+#include <config.h>
+
 #include <dlfcn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <psys_impl.h>
+#include <psys_probes.h>
 
 static const char *_fallbacks[] = {
 	"dpkg",
@@ -68,23 +71,45 @@ static void *fallback_sym(void *impl, const char *name, const char *fallback)
 
 static const char *fallback_find(void *impl)
 {
+	struct psys_phase phase;
 	const char **fb;
 	
+	psys_phase_begin(&phase, PSYS_PHASE_PROBE);
+
 	for (fb = _fallbacks; *fb != NULL; fb++) {
 		int (*fn)(void);
 		fn = fallback_sym(impl, "fallback_match", *fb);
 		if (fn && (*fn)())
-			return *fb;
+			goto out;
 	}
 
 	for (fb = _fallbacks; *fb != NULL; fb++) {
 		int (*fn)();
 		fn = fallback_sym(impl, "fallback_match_fuzzy", *fb);
 		if (fn && (*fn)())
-			return *fb;
+			goto out;
 	}
 	
-	return NULL;
+out:
+	/* If no fallback matched, fb points to the terminating NULL */
+	PSYS_PROBE1(backend__select, *fb);
+	psys_phase_end(&phase);
+	return *fb;
+}
+
+/*
+ * Looks up a backend entry point in the fallback backend matching the
+ * system
+ */
+static void *fallback_entry(void *impl, const char *name)
+{
+	struct psys_span span;
+	void *sym;
+
+	psys_span_begin(&span, "fallback_dispatch");
+	sym = fallback_sym(impl, name, NULL);
+	psys_span_end(&span);
+	return sym;
 }
 
 /*** Adding packages to the system package database ***************************/
@@ -98,7 +123,7 @@ static int announce_or_register(const char *sym, psys_pkg_t pkg,
 	impl = dlopen(NULL, RTLD_LAZY);
 	if (impl) {
 		fn = (int (*)(psys_pkg_t, psys_err_t *))
-				fallback_sym(impl, sym, NULL);
+				fallback_entry(impl, sym);
 
 		if (fn) {
 			int ret;
@@ -150,7 +175,7 @@ static int unannounce_or_unregister(const char *sym,
 	impl = dlopen(NULL, RTLD_LAZY);
 	if (impl) {
 		fn = (int (*)(const char *, const char *, psys_err_t *))
-				fallback_sym(impl, sym, NULL);
+				fallback_entry(impl, sym);
 
 		if (fn) {
 			int ret;
@@ -175,3 +200,191 @@ int _psys_unregister(const char *vendor, const char *name, psys_err_t *err)
 {
 	return unannounce_or_unregister("psys_unregister", vendor, name, err);
 }
+
+int _psys_unregister_many(const char * const *vendors,
+			  const char * const *names, size_t count,
+			  psys_err_t *err)
+{
+	void *impl;
+	int (*fn)(const char * const *, const char * const *, size_t,
+		  psys_err_t *);
+
+	impl = dlopen(NULL, RTLD_LAZY);
+	if (impl) {
+		fn = (int (*)(const char * const *, const char * const *,
+			      size_t, psys_err_t *))
+				fallback_entry(impl, "psys_unregister_many");
+
+		if (fn) {
+			int ret;
+			ret = (*fn)(vendors, names, count, err);
+			dlclose(impl);
+			return ret;
+		}
+
+		dlclose(impl);
+	}
+
+	psys_err_set_notimpl(err);
+	return -1;
+}
+
+/*** Querying installed packages *********************************************/
+
+int _psys_query(const char *vendor, const char *name, char **version,
+		psys_err_t *err)
+{
+	void *impl;
+	int (*fn)(const char *, const char *, char **, psys_err_t *);
+
+	impl = dlopen(NULL, RTLD_LAZY);
+	if (impl) {
+		fn = (int (*)(const char *, const char *, char **,
+			      psys_err_t *))
+				fallback_entry(impl, "psys_query");
+
+		if (fn) {
+			int ret;
+			ret = (*fn)(vendor, name, version, err);
+			dlclose(impl);
+			return ret;
+		}
+
+		dlclose(impl);
+	}
+
+	psys_err_set_notimpl(err);
+	return -1;
+}
+
+/*** Looking up file owners **************************************************/
+
+int _psys_owner_of(const char *path, char **vendor, char **name,
+		   psys_err_t *err)
+{
+	void *impl;
+	int (*fn)(const char *, char **, char **, psys_err_t *);
+
+	impl = dlopen(NULL, RTLD_LAZY);
+	if (impl) {
+		fn = (int (*)(const char *, char **, char **, psys_err_t *))
+				fallback_entry(impl, "psys_owner_of");
+
+		if (fn) {
+			int ret;
+			ret = (*fn)(path, vendor, name, err);
+			dlclose(impl);
+			return ret;
+		}
+
+		dlclose(impl);
+	}
+
+	psys_err_set_notimpl(err);
+	return -1;
+}
+
+/*** Listing installed packages **********************************************/
+
+/*
+ * The backend is determined once when the list is opened; the iteration
+ * functions then go directly to the backend's implementations.
+ */
+struct fallback_list {
+	void *impl;
+	void *list;
+	int (*next)(void *, const char **, const char **, const char **,
+		    const char **, psys_err_t *);
+	void (*close)(void *);
+};
+
+void *_psys_list_open(psys_err_t *err)
+{
+	const char *fallback;
+	struct fallback_list *fl;
+	void *(*open_fn)(psys_err_t *);
+
+	fl = calloc(1, sizeof(*fl));
+	if (!fl) {
+		psys_err_set_nomem(err);
+		return NULL;
+	}
+
+	fl->impl = dlopen(NULL, RTLD_LAZY);
+	if (!fl->impl)
+		goto notimpl;
+
+	fallback = fallback_find(fl->impl);
+	if (!fallback)
+		goto notimpl;
+
+	open_fn = (void *(*)(psys_err_t *))
+			fallback_sym(fl->impl, "psys_list_open", fallback);
+	fl->next = (int (*)(void *, const char **, const char **,
+			    const char **, const char **, psys_err_t *))
+			fallback_sym(fl->impl, "psys_list_next", fallback);
+	fl->close = (void (*)(void *))
+			fallback_sym(fl->impl, "psys_list_close", fallback);
+	if (!open_fn || !fl->next || !fl->close)
+		goto notimpl;
+
+	fl->list = (*open_fn)(err);
+	if (!fl->list) {
+		dlclose(fl->impl);
+		free(fl);
+		return NULL;
+	}
+
+	return fl;
+notimpl:
+	if (fl->impl)
+		dlclose(fl->impl);
+	free(fl);
+	psys_err_set_notimpl(err);
+	return NULL;
+}
+
+int _psys_list_next(void *list, const char **vendor, const char **name,
+		    const char **version, const char **arch, psys_err_t *err)
+{
+	struct fallback_list *fl = list;
+	return (*fl->next)(fl->list, vendor, name, version, arch, err);
+}
+
+void _psys_list_close(void *list)
+{
+	struct fallback_list *fl = list;
+
+	(*fl->close)(fl->list);
+	dlclose(fl->impl);
+	free(fl);
+}
+
+/*** Verifying installed packages *********************************************/
+
+int _psys_verify(const char *vendor, const char *name, int mode,
+		 psys_verify_fn fn, void *data, psys_err_t *err)
+{
+	void *impl;
+	int (*impl_fn)(const char *, const char *, int, psys_verify_fn,
+		       void *, psys_err_t *);
+
+	impl = dlopen(NULL, RTLD_LAZY);
+	if (impl) {
+		impl_fn = (int (*)(const char *, const char *, int,
+				   psys_verify_fn, void *, psys_err_t *))
+				fallback_entry(impl, "psys_verify");
+
+		if (impl_fn) {
+			int ret;
+			ret = (*impl_fn)(vendor, name, mode, fn, data, err);
+			dlclose(impl);
+			return ret;
+		}
+
+		dlclose(impl);
+	}
+
+	psys_err_set_notimpl(err);
+	return -1;
+}
@@ -27,6 +27,8 @@
 /* Needed for asprintf */
 #define _GNU_SOURCE
 
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
@@ -35,6 +37,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -174,41 +177,569 @@ static const char *dpkg_arch(const char *lsbarch, psys_err_t *err)
 	return dpkgarch;
 }
 
+/* Loads and locks the package database */
+static void db_open(void)
+{
+	struct psys_phase phase;
+
+	psys_phase_begin(&phase, PSYS_PHASE_DB_OPEN);
+	modstatdb_init(ADMINDIR, msdbrw_needsuperuser);
+	psys_phase_end(&phase);
+}
+
+/* Writes back changes to the package database and unlocks it */
+static void db_close(void)
+{
+	struct psys_phase phase;
+
+	psys_phase_begin(&phase, PSYS_PHASE_DB_COMMIT);
+	modstatdb_shutdown();
+	psys_phase_end(&phase);
+}
+
 static void error_printer_fn(const char *emsg, psys_err_t *err)
 {
 	psys_err_set(err, PSYS_EINTERNAL, emsg);
 }
 
+/*** Reading the status file directly *****************************************/
+
+/*
+ * Loading the package database with modstatdb_init() parses every stanza
+ * of the status and available files, and requires superuser privileges
+ * for taking the database lock. For read-only lookups, we map the status
+ * file instead and only parse the stanzas we are interested in.
+ *
+ * dpkg writes changes to journal files in the updates/ directory first
+ * and only merges them into the status file from time to time, so the
+ * journal needs to be searched as well (later entries win).
+ */
+
+struct status_info {
+	int found;
+	int installed;
+	char *version;
+	char *arch;
+	char *maintainer;
+};
+
+struct mapped_file {
+	const char *data;
+	size_t size;
+};
+
+static int map_file(const char *path, struct mapped_file *mf,
+		    psys_err_t *err)
+{
+	struct stat st;
+	int fd;
+
+	mf->data = NULL;
+	mf->size = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		psys_err_set(err, (errno == EACCES) ? PSYS_EACCESS :
+						       PSYS_EINTERNAL,
+			     "Cannot open `%s': %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		psys_err_set(err, PSYS_EINTERNAL,
+			     "Cannot stat `%s': %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size > 0) {
+		void *data;
+
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			psys_err_set(err, PSYS_EINTERNAL,
+				     "Cannot map `%s': %s",
+				     path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		mf->data = data;
+		mf->size = st.st_size;
+	}
+
+	close(fd);
+	return 0;
+}
+
+static void unmap_file(struct mapped_file *mf)
+{
+	if (mf->data)
+		munmap((void *) mf->data, mf->size);
+}
+
+/*
+ * Returns the length of the stanza starting at `start', including the
+ * final newline.
+ */
+static size_t stanza_len(const char *start, const char *end)
+{
+	const char *stanza_end;
+
+	stanza_end = memmem(start, end - start, "\n\n", 2);
+	return (stanza_end ? stanza_end + 1 : end) - start;
+}
+
+/* Returns the start of the stanza containing the line starting at `line' */
+static const char *stanza_start(const char *data, const char *line)
+{
+	const char *start;
+
+	/* dpkg writes the Package field first, but don't rely on it */
+	start = line;
+	while (start > data &&
+	       !(start[-1] == '\n' && (start - 1 == data || start[-2] == '\n')))
+		start--;
+	return start;
+}
+
+/*
+ * Finds the stanza containing the line `needle' (which must include the
+ * trailing newline). memmem() is vectorized in glibc, so this is about as
+ * fast as scanning the file can get.
+ */
+static const char *stanza_find(const char *data, size_t size,
+			       const char *needle, size_t *len)
+{
+	const char *p, *start, *end;
+	size_t needle_len;
+
+	end = data + size;
+	needle_len = strlen(needle);
+
+	for (p = data; p < end; p += needle_len) {
+		p = memmem(p, end - p, needle, needle_len);
+		if (!p)
+			break;
+		if (p != data && p[-1] != '\n')
+			continue;
+
+		start = stanza_start(data, p);
+		*len = stanza_len(start, end);
+		return start;
+	}
+	return NULL;
+}
+
+static int stanza_field(const char *stanza, size_t len, const char *field,
+			const char **value, size_t *vlen)
+{
+	const char *p, *eol, *end;
+	size_t flen;
+
+	flen = strlen(field);
+	end = stanza + len;
+
+	for (p = stanza; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (!eol)
+			eol = end;
+
+		if (eol - p > flen && p[flen] == ':' &&
+		    !memcmp(p, field, flen)) {
+			p += flen + 1;
+			while (p < eol && *p == ' ')
+				p++;
+			*value = p;
+			*vlen = eol - p;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void status_info_free(struct status_info *info)
+{
+	free(info->version);
+	free(info->arch);
+	free(info->maintainer);
+	memset(info, 0, sizeof(*info));
+}
+
+static int status_info_parse(const char *stanza, size_t len,
+			     struct status_info *info)
+{
+	const char *value;
+	size_t vlen;
+
+	status_info_free(info);
+	info->found = 1;
+
+	/* "Status: <want> <flag> <status>" */
+	if (stanza_field(stanza, len, "Status", &value, &vlen) &&
+	    vlen >= 10 && !memcmp(value + vlen - 10, " installed", 10))
+		info->installed = 1;
+
+	/*
+	 * Like pkginfo.installed.version.version, we only want the
+	 * upstream part of "[epoch:]upstream[-revision]".
+	 */
+	if (stanza_field(stanza, len, "Version", &value, &vlen)) {
+		const char *colon, *dash;
+
+		colon = memchr(value, ':', vlen);
+		if (colon) {
+			vlen -= colon + 1 - value;
+			value = colon + 1;
+		}
+		for (dash = value + vlen; dash > value && dash[-1] != '-';
+		     dash--)
+			;
+		if (dash > value)
+			vlen = dash - 1 - value;
+
+		info->version = strndup(value, vlen);
+		if (!info->version)
+			return -1;
+	}
+
+	if (stanza_field(stanza, len, "Architecture", &value, &vlen)) {
+		info->arch = strndup(value, vlen);
+		if (!info->arch)
+			return -1;
+	}
+
+	if (stanza_field(stanza, len, "Maintainer", &value, &vlen)) {
+		info->maintainer = strndup(value, vlen);
+		if (!info->maintainer)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int status_search(const char *path, const char *needle,
+			 struct status_info *info, psys_err_t *err)
+{
+	struct mapped_file mf;
+	const char *stanza;
+	size_t len;
+	int ret;
+
+	if (map_file(path, &mf, err))
+		return -1;
+
+	ret = 0;
+	stanza = mf.data ? stanza_find(mf.data, mf.size, needle, &len) : NULL;
+	if (stanza && status_info_parse(stanza, len, info)) {
+		psys_err_set_nomem(err);
+		ret = -1;
+	}
+
+	unmap_file(&mf);
+	return ret;
+}
+
+static int journal_filter(const struct dirent *d)
+{
+	const char *c;
+
+	/* Journal entries are named by sequence number */
+	for (c = d->d_name; *c; c++) {
+		if (!isdigit((unsigned char) *c))
+			return 0;
+	}
+	return c != d->d_name;
+}
+
+static int status_lookup(const char *dpkgname, struct status_info *info,
+			 psys_err_t *err)
+{
+	struct dirent **journal;
+	char *needle;
+	int i, n, ret;
+
+	memset(info, 0, sizeof(*info));
+
+	if (asprintf(&needle, "Package: %s\n", dpkgname) < 0) {
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	if (status_search(ADMINDIR "/status", needle, info, err)) {
+		free(needle);
+		return -1;
+	}
+
+	ret = 0;
+	n = scandir(ADMINDIR "/updates", &journal, journal_filter, alphasort);
+	for (i = 0; i < n; i++) {
+		char *path;
+
+		if (!ret) {
+			if (asprintf(&path, ADMINDIR "/updates/%s",
+				     journal[i]->d_name) < 0) {
+				psys_err_set_nomem(err);
+				ret = -1;
+			} else {
+				ret = status_search(path, needle, info, err);
+				free(path);
+			}
+		}
+		free(journal[i]);
+	}
+	if (n >= 0)
+		free(journal);
+
+	free(needle);
+	if (ret)
+		status_info_free(info);
+	return ret;
+}
+
+/*** Indexing package file owners *********************************************/
+
+/*
+ * Which registered package owns which file is recorded in an owner index
+ * (see psys_index_lookup()) next to the status file, which is updated on
+ * each register and unregister. If it does not exist yet, e.g. because
+ * packages were registered with an older libpsys, the next register or
+ * unregister builds it from the packages' .list files while holding the
+ * package database lock. The same goes for the index's Bloom filter. Until
+ * then, lookups search the .list files directly.
+ */
+
+#define OWNER_INDEX ADMINDIR "/psys-owners"
+
+/* Defined in the psys_list_packages() and psys_verify() sections */
+void *dpkg_psys_list_open(psys_err_t *err);
+int dpkg_psys_list_next(void *list, const char **vendor, const char **name,
+			const char **version, const char **arch,
+			psys_err_t *err);
+void dpkg_psys_list_close(void *list);
+static int read_file_list(const char *dpkgname, void *md5tree,
+			  psys_flist_t *files, psys_err_t *err);
+
+struct owner_data {
+	const char *path;
+	char *vendor;
+	char *name;
+	psys_err_t *err;
+};
+
+/*
+ * Calls fn for each package registered by psys with the package's file
+ * list, until fn returns a value other than 0
+ */
+static int foreach_registered(int (*fn)(const char *, const char *,
+					psys_flist_t, void *, psys_err_t *),
+			      void *data, psys_err_t *err)
+{
+	void *list;
+	const char *vendor, *name, *version, *arch;
+	int ret;
+
+	list = dpkg_psys_list_open(err);
+	if (!list)
+		return -1;
+
+	while ((ret = dpkg_psys_list_next(list, &vendor, &name, &version,
+					  &arch, err)) > 0) {
+		psys_flist_t files = NULL;
+		psys_err_t lerr = NULL;
+		char *dpkgname;
+
+		if (asprintf(&dpkgname, "lsb-%s-%s", vendor, name) < 0) {
+			psys_err_set_nomem(err);
+			ret = -1;
+			break;
+		}
+
+		ret = read_file_list(dpkgname, NULL, &files, &lerr);
+		free(dpkgname);
+		if (ret == 0) {
+			ret = (*fn)(vendor, name, files, data, err);
+		} else if (psys_err_code(lerr) == PSYS_ENOENT) {
+			/* No .list file, so there are no files to consider */
+			psys_err_free(lerr);
+			ret = 0;
+		} else if (err) {
+			*err = lerr;
+		} else {
+			psys_err_free(lerr);
+		}
+
+		psys_flist_free(files);
+		if (ret)
+			break;
+	}
+
+	dpkg_psys_list_close(list);
+	return ret;
+}
+
+static int index_add_fn(const char *vendor, const char *name,
+			psys_flist_t files, void *data, psys_err_t *err)
+{
+	return psys_index_builder_add(data, vendor, name, files, err);
+}
+
+/*
+ * Builds the owner index if it does not exist yet. Must only be called
+ * with the package database locked (see db_open()), so that no package
+ * can be registered or unregistered while the index is built.
+ */
+static int ensure_owner_index(psys_err_t *err)
+{
+	psys_index_builder_t b;
+	int ret;
+
+	if (access(OWNER_INDEX, F_OK)) {
+		b = psys_index_builder_new(err);
+		if (!b)
+			return -1;
+
+		ret = foreach_registered(index_add_fn, b, err);
+		if (!ret)
+			ret = psys_index_builder_save(b, OWNER_INDEX, err);
+		psys_index_builder_free(b);
+		if (ret)
+			return -1;
+	}
+
+	/*
+	 * Lookups work without the filter, just more slowly, so failing to
+	 * create it (e.g. for lack of privileges) is not an error
+	 */
+	if (access(OWNER_INDEX ".bloom", F_OK))
+		psys_index_build_filter(OWNER_INDEX, NULL);
+	return 0;
+}
+
+/*
+ * Opens the owner index for reading. If it has not been built yet (see
+ * ensure_owner_index()), *idx is set to NULL, which makes find_owner()
+ * search the package file lists directly.
+ */
+static int open_owner_index(psys_index_t *idx, psys_err_t *err)
+{
+	*idx = NULL;
+	if (access(OWNER_INDEX, F_OK))
+		return 0;
+
+	*idx = psys_index_open(OWNER_INDEX, err);
+	return *idx ? 0 : -1;
+}
+
+static int owner_found(struct owner_data *od, const char *vendor,
+		       const char *name)
+{
+	od->vendor = strdup(vendor);
+	od->name = strdup(name);
+	if (!od->vendor || !od->name) {
+		free(od->vendor);
+		free(od->name);
+		od->vendor = od->name = NULL;
+		psys_err_set_nomem(od->err);
+		return -1;
+	}
+	return 1;
+}
+
+static int owner_fn(const char *vendor, const char *name, void *data)
+{
+	struct owner_data *od = data;
+	struct status_info info;
+	char *dpkgname;
+	int installed;
+
+	/*
+	 * The index does not know about packages removed with dpkg
+	 * directly, so check that the owner is still installed
+	 */
+	if (asprintf(&dpkgname, "lsb-%s-%s", vendor, name) < 0) {
+		psys_err_set_nomem(od->err);
+		return -1;
+	}
+	if (status_lookup(dpkgname, &info, od->err)) {
+		free(dpkgname);
+		return -1;
+	}
+	installed = info.installed;
+	status_info_free(&info);
+	free(dpkgname);
+
+	return installed ? owner_found(od, vendor, name) : 0;
+}
+
+static int owner_scan_fn(const char *vendor, const char *name,
+			 psys_flist_t files, void *data, psys_err_t *err)
+{
+	struct owner_data *od = data;
+	psys_flist_t f;
+
+	for (f = files; f; f = psys_flist_next(f)) {
+		if (!strcmp(psys_flist_path(f), od->path))
+			return owner_found(od, vendor, name);
+	}
+	return 0;
+}
+
+/*
+ * Looks up the registered package owning `path' in the owner index `idx'
+ * (see open_owner_index()). Returns 1 and sets od->vendor and od->name if
+ * there is one, 0 if not and -1 on error.
+ */
+static int find_owner(psys_index_t idx, const char *path,
+		      struct owner_data *od, psys_err_t *err)
+{
+	od->path = path;
+	od->vendor = od->name = NULL;
+	od->err = err;
+
+	if (!idx)
+		return foreach_registered(owner_scan_fn, od, err);
+	return psys_index_find(idx, path, owner_fn, od, err);
+}
+
 /*** Sanity checks ************************************************************/
 
-int ensure_installed(struct pkginfo *dpkg, psys_err_t *err)
+/*
+ * The checks take the relevant package data as plain values, so that they
+ * can be used both with the package database loaded by modstatdb_init()
+ * (when registering) and with data read from the status file directly
+ * (when announcing, see status_lookup()).
+ */
+
+int ensure_installed(const char *dpkgname, int installed, psys_err_t *err)
 {
-	if (dpkg->status != stat_installed) {
+	if (!installed) {
 		psys_err_set(err, PSYS_ENOENT,
 			     "Package named `%s' is not installed",
-			     dpkg->name);
+			     dpkgname);
 		return -1;
 	}
 	return 0;
 }
 
-int ensure_not_installed(struct pkginfo *dpkg, psys_err_t *err)
+int ensure_not_installed(const char *dpkgname, int installed,
+			 psys_err_t *err)
 {
-	if (dpkg->status == stat_installed) {
+	if (installed) {
 		psys_err_set(err, PSYS_EEXIST,
 			     "A package named `%s' is already installed",
-			     dpkg->name);
+			     dpkgname);
 		return -1;
 	}
 	return 0;
 }
 
-int ensure_dependencies_met(psys_pkg_t pkg, psys_err_t *err)
+/* `lsbversion' is the version of the `lsb' package, or NULL if missing */
+int ensure_dependencies_met(psys_pkg_t pkg, const char *lsbversion,
+			    psys_err_t *err)
 {
-	struct pkginfo *lsb_dpkg;
-
-	lsb_dpkg = findpackage("lsb");
-	if (lsb_dpkg->status != stat_installed) {
+	if (!lsbversion) {
 		psys_err_set(err, PSYS_ELSBVER,
 			     "The system is currently not Linux Standard "
 			     "Base (LSB) compliant: Package `lsb' is not "
@@ -216,44 +747,43 @@ int ensure_dependencies_met(psys_pkg_t pkg, psys_err_t *err)
 		return -1;
 	}
 
-	if (psys_pkg_lsbvercmp(pkg, lsb_dpkg->installed.version.version) < 0) {
+	if (psys_pkg_lsbvercmp(pkg, lsbversion) < 0) {
 		psys_err_set(err, PSYS_ELSBVER,
 			     "The system's Linux Standard Base (LSB) "
 			     "compliance is not sufficient: version %s is "
 			     "required, but package `lsb' is at version %s",
-			     psys_pkg_lsbversion(pkg),
-			     lsb_dpkg->installed.version);
+			     psys_pkg_lsbversion(pkg), lsbversion);
 		return -1;
 	}
 
 	return 0;
 }
 
-static int ensure_version_newer(psys_pkg_t pkg, struct pkginfo *dpkg,
-				psys_err_t *err)
+static int ensure_version_newer(psys_pkg_t pkg, const char *dpkgname,
+				const char *dpkgversion, psys_err_t *err)
 {
-	const char *dpkgversion;
 	int diff;
 
-	dpkgversion = dpkg->installed.version.version;
 	diff = psys_pkg_vercmp(pkg, dpkgversion);
 	if (diff < 0) {
 		psys_err_set(err, PSYS_EVER,
 			     "Installed package `%s' is newer than version "
 			     "%s (%s)",
-			     dpkg->name, psys_pkg_version(pkg), dpkgversion);
+			     dpkgname, psys_pkg_version(pkg), dpkgversion);
 		return -1;
 	} else if (diff == 0) {
 		psys_err_set(err, PSYS_EVER,
 			     "Package `%s' is already at version %s",
-			     dpkg->name, dpkgversion);
+			     dpkgname, dpkgversion);
 		return -1;
 	}
 	return 0;
 }
 
-static int ensure_no_conflict(psys_plist_t p, psys_err_t *err)
+static int ensure_no_conflict(psys_index_t owners, psys_plist_t p,
+			      psys_err_t *err)
 {
+	struct owner_data od;
 	int rc;
 
 	rc = access(psys_plist_path(p), F_OK);
@@ -269,41 +799,56 @@ static int ensure_no_conflict(psys_plist_t p, psys_err_t *err)
 			     psys_plist_path(p), strerror(errno));
 		return -1;
 	}
-	return 0;
+
+	/* The file might be missing, but still belong to another package */
+	rc = find_owner(owners, psys_plist_path(p), &od, err);
+	if (rc > 0) {
+		psys_err_set(err, PSYS_ECONFLICT,
+			     "File name `%s' is already used by package "
+			     "`%s' of vendor `%s'",
+			     od.path, od.name, od.vendor);
+		free(od.vendor);
+		free(od.name);
+		return -1;
+	}
+	return rc;
 }
 
 static int ensure_no_conflicting_extras(psys_pkg_t pkg, psys_err_t *err) {
+	psys_index_t owners;
 	psys_plist_t e;
 
+	if (!psys_pkg_extras(pkg))
+		return 0;
+
+	/*
+	 * Open the owner index once, so that the check for each extra file
+	 * usually only needs to consult its Bloom filter
+	 */
+	if (open_owner_index(&owners, err))
+		return -1;
+
 	for (e = psys_pkg_extras(pkg); e; e = psys_plist_next(e)) {
-		if (ensure_no_conflict(e, err))
+		if (ensure_no_conflict(owners, e, err)) {
+			psys_index_close(owners);
 			return -1;
+		}
 	}
 
+	psys_index_close(owners);
 	return 0;
 }
 
 /*** Adding package metadata **************************************************/
 
-static const char *tlist_value_c(psys_tlist_t list)
-{
-	psys_tlist_t t;
-
-	for (t = list; t; t = psys_tlist_next(t)) {
-		if (!strcmp(psys_tlist_locale(t), "C"))
-			return psys_tlist_value(t);
-	}
-	return NULL;
-}
-
 static void set_description(struct pkginfo *dpkg, psys_pkg_t pkg)
 {
 	const char *pkg_summary;
 	const char *pkg_description;
 	char *dpkg_description;
 
-	pkg_summary = tlist_value_c(psys_pkg_summary(pkg));
-	pkg_description = tlist_value_c(psys_pkg_description(pkg));
+	pkg_summary = psys_tlist_default(psys_pkg_summary(pkg));
+	pkg_description = psys_tlist_default(psys_pkg_description(pkg));
 
 	if (pkg_summary && pkg_description) {
 		int len;
@@ -489,7 +1034,7 @@ int add_to_md5sums_list(FILE *list, psys_flist_t file, psys_err_t *err)
 			return -1;
 
 		rc = fprintf(list, "%s %s\n", md5, psys_flist_path(file) + 1);
-		free(md5);
+		psys_free(md5);
 		if (rc < 0) {
 			psys_err_set(err, PSYS_EINTERNAL,
 				     "Cannot write to md5sums list: %s",
@@ -533,28 +1078,43 @@ void remove_info_files(struct pkginfo *dpkg)
 int dpkg_psys_announce(psys_pkg_t pkg, psys_err_t *err)
 {
 	int ret;
-	jmp_buf buf;
 	char *dpkgname = NULL;
-	struct pkginfo *dpkg;
+	struct status_info info, lsb_info;
 
-	pkg = psys_pkg_copy(pkg);
+	pkg = psys_pkg_freeze(pkg);
 	if (!pkg) {
 		psys_err_set_nomem(err);
 		return -1;
 	}
-	psys_pkg_assert_valid(pkg);
 
-	init_error_handler(err, buf, out);
-	modstatdb_init(ADMINDIR, msdbrw_needsuperuser);
+	memset(&info, 0, sizeof(info));
+	memset(&lsb_info, 0, sizeof(lsb_info));
 
-	dpkgname = dpkg_name(psys_pkg_vendor(pkg), psys_pkg_name(pkg));
-	dpkg = findpackage(dpkgname);
-	if (ensure_not_installed(dpkg, err)) {
+	if (asprintf(&dpkgname, "lsb-%s-%s", psys_pkg_vendor(pkg),
+		     psys_pkg_name(pkg)) < 0) {
+		dpkgname = NULL;
+		psys_err_set_nomem(err);
 		ret = -1;
 		goto out;
 	}
 
-	if (ensure_dependencies_met(pkg, err)) {
+	/*
+	 * Announcing only checks, so the status file is read directly
+	 * instead of locking and loading the whole package database
+	 */
+	if (status_lookup(dpkgname, &info, err) ||
+	    status_lookup("lsb", &lsb_info, err)) {
+		ret = -1;
+		goto out;
+	}
+
+	if (ensure_not_installed(dpkgname, info.installed, err)) {
+		ret = -1;
+		goto out;
+	}
+
+	if (ensure_dependencies_met(pkg, lsb_info.installed ?
+					 lsb_info.version : NULL, err)) {
 		ret = -1;
 		goto out;
 	}
@@ -566,8 +1126,9 @@ int dpkg_psys_announce(psys_pkg_t pkg, psys_err_t *err)
 
 	ret = 0;
 out:
-	modstatdb_shutdown();
-	cleanup();
+	status_info_free(&info);
+	status_info_free(&lsb_info);
+	free(dpkgname);
 	psys_pkg_free(pkg);
 	return ret;
 }
@@ -579,21 +1140,29 @@ static int do_register(psys_pkg_t pkg, psys_err_t *err, jmp_buf *buf)
 	int ret;
 	char *dpkgname = NULL;
 	const char *dpkgarch;
-	struct pkginfo *dpkg;
+	struct pkginfo *dpkg, *lsb_dpkg;
 	psys_flist_t flist = NULL;
+	psys_flist_t listed = NULL;
 	char *filelist_path = NULL;
 	char *md5list_path = NULL;
+	struct psys_phase phase;
+	/* Set while the phase runs; volatile as it must survive longjmp() */
+	volatile int in_phase = 0;
 
 	set_error_handler(err, *buf, out);
 
 	dpkgname = dpkg_name(psys_pkg_vendor(pkg), psys_pkg_name(pkg));
 	dpkg = findpackage(dpkgname);
-	if (ensure_not_installed(dpkg, err)) {
+	if (ensure_not_installed(dpkgname, dpkg->status == stat_installed,
+				 err)) {
 		ret = -1;
 		goto out;
 	}
 
-	if (ensure_dependencies_met(pkg, err)) {
+	lsb_dpkg = findpackage("lsb");
+	if (ensure_dependencies_met(pkg, (lsb_dpkg->status == stat_installed) ?
+					 lsb_dpkg->installed.version.version :
+					 NULL, err)) {
 		ret = -1;
 		goto out;
 	}
@@ -641,6 +1210,15 @@ static int do_register(psys_pkg_t pkg, psys_err_t *err, jmp_buf *buf)
 	/* Installed Size */
 	set_installed_size(dpkg, flist);
 
+	/* MD5 sums for the MD5SUMS list */
+	if (psys_flist_md5sums(flist, err)) {
+		ret = -1;
+		goto out;
+	}
+
+	psys_phase_begin(&phase, PSYS_PHASE_INFO_WRITE);
+	in_phase = 1;
+
 	/* File List */
 	filelist_path = create_file_list(dpkg, flist, err);
 	if (!filelist_path) {
@@ -655,12 +1233,30 @@ static int do_register(psys_pkg_t pkg, psys_err_t *err, jmp_buf *buf)
 		goto out;
 	}
 
+	/*
+	 * Owner Index. Index the paths as read back from the file list,
+	 * which adds the files' parent directories, so that the entries
+	 * are the same as when the index is built from the file lists.
+	 */
+	if (read_file_list(dpkgname, NULL, &listed, err) ||
+	    ensure_owner_index(err) ||
+	    psys_index_update(OWNER_INDEX, psys_pkg_vendor(pkg),
+			      psys_pkg_name(pkg), listed, err)) {
+		ret = -1;
+		goto out;
+	}
+
+	psys_phase_end(&phase);
+	in_phase = 0;
+
 	dpkg->want = want_install;
 	dpkg->status = stat_installed;
 	modstatdb_note(dpkg);
 
 	ret = 0;
 out:
+	if (in_phase)
+		psys_phase_end(&phase);
 	if (md5list_path) {
 		if (ret == -1)
 			remove(md5list_path);
@@ -671,6 +1267,8 @@ out:
 			remove(filelist_path);
 		free(filelist_path);
 	}
+	if (listed)
+		psys_flist_free(listed);
 	if (flist)
 		psys_flist_free(flist);
 	return ret;
@@ -682,19 +1280,18 @@ int dpkg_psys_register(psys_pkg_t pkg, psys_err_t *err)
 	int ret;
 	jmp_buf buf;
 
-	pkg = psys_pkg_copy(pkg);
+	pkg = psys_pkg_freeze(pkg);
 	if (!pkg) {
 		psys_err_set_nomem(err);
 		return -1;
 	}
-	psys_pkg_assert_valid(pkg);
 
 	init_error_handler(err, buf, out);
-	modstatdb_init(ADMINDIR, msdbrw_needsuperuser);
+	db_open();
 
 	ret = do_register(pkg, err, &buf);
 out:
-	modstatdb_shutdown();
+	db_close();
 	cleanup();
 	psys_pkg_free(pkg);
 	return ret;
@@ -705,36 +1302,44 @@ out:
 int dpkg_psys_announce_update(psys_pkg_t pkg, psys_err_t *err)
 {
 	int ret;
-	jmp_buf buf;
-	char *dpkgname;
-	struct pkginfo *dpkg;
+	char *dpkgname = NULL;
+	struct status_info info;
 
-	pkg = psys_pkg_copy(pkg);
+	pkg = psys_pkg_freeze(pkg);
 	if (!pkg) {
 		psys_err_set_nomem(err);
 		return -1;
 	}
-	psys_pkg_assert_valid(pkg);
 
-	init_error_handler(err, buf, out);
-	modstatdb_init(ADMINDIR, msdbrw_needsuperuser);
+	memset(&info, 0, sizeof(info));
 
-	dpkgname = dpkg_name(psys_pkg_vendor(pkg), psys_pkg_name(pkg));
-	dpkg = findpackage(dpkgname);
-	if (ensure_installed(dpkg, err)) {
+	if (asprintf(&dpkgname, "lsb-%s-%s", psys_pkg_vendor(pkg),
+		     psys_pkg_name(pkg)) < 0) {
+		dpkgname = NULL;
+		psys_err_set_nomem(err);
+		ret = -1;
+		goto out;
+	}
+
+	if (status_lookup(dpkgname, &info, err)) {
 		ret = -1;
 		goto out;
 	}
 
-	if (ensure_version_newer(pkg, dpkg, err)) {
+	if (ensure_installed(dpkgname, info.installed && info.version, err)) {
+		ret = -1;
+		goto out;
+	}
+
+	if (ensure_version_newer(pkg, dpkgname, info.version, err)) {
 		ret = -1;
 		goto out;
 	}
 
 	ret = 0;
 out:
-	modstatdb_shutdown();
-	cleanup();
+	status_info_free(&info);
+	free(dpkgname);
 	psys_pkg_free(pkg);
 	return ret;
 }
@@ -748,24 +1353,24 @@ int dpkg_psys_register_update(psys_pkg_t pkg, psys_err_t *err)
 	char *dpkgname;
 	struct pkginfo *dpkg;
 
-	pkg = psys_pkg_copy(pkg);
+	pkg = psys_pkg_freeze(pkg);
 	if (!pkg) {
 		psys_err_set_nomem(err);
 		return -1;
 	}
-	psys_pkg_assert_valid(pkg);
 
 	init_error_handler(err, buf, out);
-	modstatdb_init(ADMINDIR, msdbrw_needsuperuser);
+	db_open();
 
 	dpkgname = dpkg_name(psys_pkg_vendor(pkg), psys_pkg_name(pkg));
 	dpkg = findpackage(dpkgname);
-	if (ensure_installed(dpkg, err)) {
+	if (ensure_installed(dpkgname, dpkg->status == stat_installed, err)) {
 		ret = -1;
 		goto out;
 	}
 
-	if (ensure_version_newer(pkg, dpkg, err)) {
+	if (ensure_version_newer(pkg, dpkgname,
+				 dpkg->installed.version.version, err)) {
 		ret = -1;
 		goto out;
 	}
@@ -773,7 +1378,7 @@ int dpkg_psys_register_update(psys_pkg_t pkg, psys_err_t *err)
 	dpkg->status = stat_notinstalled;
 	ret = do_register(pkg, err, &buf);
 out:
-	modstatdb_shutdown();
+	db_close();
 	cleanup();
 	psys_pkg_free(pkg);
 	return ret;
@@ -784,55 +1389,567 @@ out:
 int dpkg_psys_unannounce(const char *vendor, const char *name, psys_err_t *err)
 {
 	int ret;
-	jmp_buf buf;
 	char *dpkgname;
-	struct pkginfo *dpkg;
+	struct status_info info;
+
+	if (asprintf(&dpkgname, "lsb-%s-%s", vendor, name) < 0) {
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	if (status_lookup(dpkgname, &info, err)) {
+		free(dpkgname);
+		return -1;
+	}
+
+	ret = ensure_installed(dpkgname, info.installed, err);
+	status_info_free(&info);
+	free(dpkgname);
+	return ret;
+}
+
+/*** psys_unregister() ********************************************************/
+
+int dpkg_psys_unregister_many(const char * const *vendors,
+			      const char * const *names, size_t count,
+			      psys_err_t *err)
+{
+	int ret;
+	jmp_buf buf;
+	size_t i;
+	struct pkginfo **dpkgs = NULL;
 
 	init_error_handler(err, buf, out);
-	modstatdb_init(ADMINDIR, msdbrw_needsuperuser);
+	db_open();
 
-	dpkgname = dpkg_name(vendor, name);
-	dpkg = findpackage(dpkgname);
-	if (ensure_installed(dpkg, err)) {
+	dpkgs = malloc((count ? count : 1) * sizeof(*dpkgs));
+	if (!dpkgs) {
+		psys_err_set_nomem(err);
 		ret = -1;
 		goto out;
 	}
 
+	/* Don't remove anything unless all packages are installed */
+	for (i = 0; i < count; i++) {
+		dpkgs[i] = findpackage(dpkg_name(vendors[i], names[i]));
+		if (ensure_installed(dpkgs[i]->name,
+				     dpkgs[i]->status == stat_installed, err)) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		struct pkginfo *dpkg = dpkgs[i];
+
+		remove_info_files(dpkg);
+		dpkg->want = want_purge;
+		dpkg->status = stat_notinstalled;
+		blankpackageperfile(&dpkg->installed);
+		modstatdb_note(dpkg);
+	}
+
+	/*
+	 * modstatdb_note() has recorded the removals for good, so drop
+	 * the packages' index entries in a single rewrite only now. If
+	 * that fails, the stale entries are harmless: lookups check that
+	 * the owner is still installed (see owner_fn()).
+	 */
+	if (!ensure_owner_index(NULL))
+		psys_index_remove(OWNER_INDEX, vendors, names, count, NULL);
+
 	ret = 0;
 out:
-	modstatdb_shutdown();
+	free(dpkgs);
+	db_close();
 	cleanup();
 	return ret;
 }
 
-/*** psys_unregister() ********************************************************/
-
 int dpkg_psys_unregister(const char *vendor, const char *name, psys_err_t *err)
+{
+	return dpkg_psys_unregister_many(&vendor, &name, 1, err);
+}
+
+/*** psys_query() *************************************************************/
+
+int dpkg_psys_query(const char *vendor, const char *name, char **version,
+		    psys_err_t *err)
 {
 	int ret;
-	jmp_buf buf;
 	char *dpkgname;
-	struct pkginfo *dpkg;
+	struct status_info info;
 
-	init_error_handler(err, buf, out);
-	modstatdb_init(ADMINDIR, msdbrw_needsuperuser);
+	if (asprintf(&dpkgname, "lsb-%s-%s", vendor, name) < 0) {
+		psys_err_set_nomem(err);
+		return -1;
+	}
 
-	dpkgname = dpkg_name(vendor, name);
-	dpkg = findpackage(dpkgname);
-	if (ensure_installed(dpkg, err)) {
+	if (status_lookup(dpkgname, &info, err)) {
+		free(dpkgname);
+		return -1;
+	}
+
+	if (!info.installed || !info.version) {
+		psys_err_set(err, PSYS_ENOENT,
+			     "Package named `%s' is not installed",
+			     dpkgname);
 		ret = -1;
-		goto out;
+	} else {
+		*version = info.version;
+		info.version = NULL;
+		ret = 0;
 	}
 
-	remove_info_files(dpkg);
-	dpkg->want = want_purge;
-	dpkg->status = stat_notinstalled;
-	blankpackageperfile(&dpkg->installed);
-	modstatdb_note(dpkg);
+	status_info_free(&info);
+	free(dpkgname);
+	return ret;
+}
+
+/*** psys_owner_of() **********************************************************/
+
+int dpkg_psys_owner_of(const char *path, char **vendor, char **name,
+		       psys_err_t *err)
+{
+	struct owner_data od;
+	psys_index_t owners;
+	int ret;
+
+	if (open_owner_index(&owners, err))
+		return -1;
+	ret = find_owner(owners, path, &od, err);
+	psys_index_close(owners);
+	if (ret < 0)
+		return -1;
+	if (ret == 0) {
+		psys_err_set(err, PSYS_ENOENT,
+			     "File `%s' does not belong to any package "
+			     "registered with psys", path);
+		return -1;
+	}
+
+	*vendor = od.vendor;
+	*name = od.name;
+	return 0;
+}
+
+/*** psys_list_packages() *****************************************************/
+
+/*
+ * Packages are streamed from the mapped status file, jumping from one
+ * "Package: lsb-" line to the next. Only the journal entries (of which
+ * there are usually few) are collected up front, as they override the
+ * status file's stanzas.
+ */
+
+struct list_stanza {
+	const char *data;
+	size_t len;
+	const char *pkgname;
+	size_t pkgname_len;
+};
+
+struct dpkg_list {
+	struct mapped_file status;
+	const char *pos;
+
+	struct mapped_file *journal;
+	int njournal;
+	struct list_stanza *overrides;
+	int noverrides;
+	int next_override;
+
+	/* Current package */
+	struct status_info info;
+	char *name;
+};
+
+static const char LIST_NEEDLE[] = "Package: lsb-";
+
+/*
+ * Finds the next stanza of an LSB package in [*pos, end) and advances
+ * *pos past it
+ */
+static int list_find(const char *data, const char *end, const char **pos,
+		     struct list_stanza *ls)
+{
+	const char *p, *eol;
+
+	for (p = *pos; p < end; p += sizeof(LIST_NEEDLE) - 1) {
+		p = memmem(p, end - p, LIST_NEEDLE, sizeof(LIST_NEEDLE) - 1);
+		if (!p)
+			break;
+		if (p != data && p[-1] != '\n')
+			continue;
+
+		ls->pkgname = p + sizeof("Package: ") - 1;
+		eol = memchr(ls->pkgname, '\n', end - ls->pkgname);
+		ls->pkgname_len = (eol ? eol : end) - ls->pkgname;
+
+		ls->data = stanza_start(data, p);
+		ls->len = stanza_len(ls->data, end);
+		*pos = ls->data + ls->len;
+		return 1;
+	}
+
+	*pos = end;
+	return 0;
+}
+
+static struct list_stanza *list_override(struct dpkg_list *l,
+					 const char *pkgname, size_t len)
+{
+	int i;
+
+	for (i = 0; i < l->noverrides; i++) {
+		struct list_stanza *ls = &l->overrides[i];
+		if (ls->pkgname_len == len && !memcmp(ls->pkgname, pkgname, len))
+			return ls;
+	}
+	return NULL;
+}
+
+static int list_read_journal(struct dpkg_list *l, psys_err_t *err)
+{
+	struct dirent **journal;
+	int i, n, ret;
+
+	n = scandir(ADMINDIR "/updates", &journal, journal_filter, alphasort);
+	if (n <= 0)
+		return 0;
+
+	ret = 0;
+	l->journal = calloc(n, sizeof(*l->journal));
+	if (!l->journal) {
+		psys_err_set_nomem(err);
+		ret = -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct mapped_file *mf;
+		struct list_stanza ls, *old, *tmp;
+		const char *pos, *end;
+		char *path;
+
+		if (ret)
+			goto next;
+
+		if (asprintf(&path, ADMINDIR "/updates/%s",
+			     journal[i]->d_name) < 0) {
+			psys_err_set_nomem(err);
+			ret = -1;
+			goto next;
+		}
+		mf = &l->journal[l->njournal];
+		ret = map_file(path, mf, err);
+		free(path);
+		if (ret || !mf->data)
+			goto next;
+		l->njournal++;
+
+		pos = mf->data;
+		end = mf->data + mf->size;
+		while (list_find(mf->data, end, &pos, &ls)) {
+			/* Later journal entries win */
+			old = list_override(l, ls.pkgname, ls.pkgname_len);
+			if (old) {
+				*old = ls;
+				continue;
+			}
+
+			tmp = realloc(l->overrides,
+				      (l->noverrides + 1) * sizeof(ls));
+			if (!tmp) {
+				psys_err_set_nomem(err);
+				ret = -1;
+				break;
+			}
+			l->overrides = tmp;
+			l->overrides[l->noverrides++] = ls;
+		}
+next:
+		free(journal[i]);
+	}
+	free(journal);
+	return ret;
+}
+
+/*
+ * Parses the stanza into l->info and l->name. Returns 1 if it describes
+ * an installed package registered by psys, 0 if not and -1 on error.
+ */
+static int list_parse(struct dpkg_list *l, const struct list_stanza *ls)
+{
+	const char *rest;
+	size_t vlen;
+
+	free(l->name);
+	l->name = NULL;
+
+	if (status_info_parse(ls->data, ls->len, &l->info))
+		return -1;
+	if (!l->info.installed || !l->info.version || !l->info.arch ||
+	    !l->info.maintainer)
+		return 0;
+
+	/* Package names are "lsb-<vendor>-<name>", Maintainer is <vendor> */
+	rest = ls->pkgname + sizeof("lsb-") - 1;
+	vlen = strlen(l->info.maintainer);
+	if (ls->pkgname_len <= sizeof("lsb-") - 1 + vlen + 1 ||
+	    memcmp(rest, l->info.maintainer, vlen) || rest[vlen] != '-')
+		return 0;
+
+	rest += vlen + 1;
+	l->name = strndup(rest, ls->pkgname + ls->pkgname_len - rest);
+	if (!l->name)
+		return -1;
+	return 1;
+}
+
+void *dpkg_psys_list_open(psys_err_t *err)
+{
+	struct dpkg_list *l;
+
+	l = calloc(1, sizeof(*l));
+	if (!l) {
+		psys_err_set_nomem(err);
+		return NULL;
+	}
+
+	if (map_file(ADMINDIR "/status", &l->status, err) ||
+	    list_read_journal(l, err)) {
+		dpkg_psys_list_close(l);
+		return NULL;
+	}
+
+	l->pos = l->status.data;
+	return l;
+}
+
+int dpkg_psys_list_next(void *list, const char **vendor, const char **name,
+			const char **version, const char **arch,
+			psys_err_t *err)
+{
+	struct dpkg_list *l = list;
+	struct list_stanza ls;
+	const char *end;
+	int ret;
+
+	end = l->status.data + l->status.size;
+	for (;;) {
+		if (l->pos && list_find(l->status.data, end, &l->pos, &ls)) {
+			if (list_override(l, ls.pkgname, ls.pkgname_len))
+				continue;
+		} else if (l->next_override < l->noverrides) {
+			ls = l->overrides[l->next_override++];
+		} else {
+			return 0;
+		}
+
+		ret = list_parse(l, &ls);
+		if (ret < 0) {
+			psys_err_set_nomem(err);
+			return -1;
+		} else if (ret > 0) {
+			*vendor = l->info.maintainer;
+			*name = l->name;
+			*version = l->info.version;
+			*arch = l->info.arch;
+			return 1;
+		}
+	}
+}
+
+void dpkg_psys_list_close(void *list)
+{
+	struct dpkg_list *l = list;
+	int i;
+
+	for (i = 0; i < l->njournal; i++)
+		unmap_file(&l->journal[i]);
+	free(l->journal);
+	free(l->overrides);
+	unmap_file(&l->status);
+	status_info_free(&l->info);
+	free(l->name);
+	free(l);
+}
+
+/*** psys_verify() ************************************************************/
+
+struct md5sums_entry {
+	char *path;
+	char md5[33];
+};
+
+static int md5sums_entry_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct md5sums_entry *) a)->path,
+		      ((const struct md5sums_entry *) b)->path);
+}
+
+static void md5sums_entry_free(void *data)
+{
+	struct md5sums_entry *e;
+
+	e = data;
+	free(e->path);
+	free(e);
+}
+
+static int read_md5sums(const char *dpkgname, void **tree, psys_err_t *err)
+{
+	char *path;
+	FILE *list;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int ret;
+
+	if (asprintf(&path, ADMINDIR "/info/%s.md5sums", dpkgname) < 0) {
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	list = fopen(path, "r");
+	free(path);
+	if (!list) {
+		/* Packages without regular files have no md5sums list */
+		if (errno == ENOENT)
+			return 0;
+		psys_err_set(err, PSYS_EINTERNAL,
+			     "Cannot open `%s.md5sums': %s",
+			     dpkgname, strerror(errno));
+		return -1;
+	}
+
+	ret = 0;
+	while ((len = getline(&line, &size, list)) > 0) {
+		struct md5sums_entry *e, **found;
+		char *file;
+
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		/* Each line is "<md5sum> <path>", path without leading '/' */
+		if (len < 34 || line[32] != ' ')
+			continue;
+		for (file = line + 32; *file == ' ' || *file == '*'; file++)
+			;
+
+		e = malloc(sizeof(*e));
+		if (!e || asprintf(&e->path, "/%s", file) < 0) {
+			free(e);
+			psys_err_set_nomem(err);
+			ret = -1;
+			break;
+		}
+		memcpy(e->md5, line, 32);
+		e->md5[32] = '\0';
+
+		found = tsearch(e, tree, md5sums_entry_cmp);
+		if (!found) {
+			md5sums_entry_free(e);
+			psys_err_set_nomem(err);
+			ret = -1;
+			break;
+		} else if (*found != e) {
+			/* Duplicate entry; keep the first one */
+			md5sums_entry_free(e);
+		}
+	}
+
+	free(line);
+	fclose(list);
+	return ret;
+}
+
+static int read_file_list(const char *dpkgname, void *md5tree,
+			  psys_flist_t *files, psys_err_t *err)
+{
+	char *path;
+	FILE *list;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int ret;
+
+	if (asprintf(&path, ADMINDIR "/info/%s.list", dpkgname) < 0) {
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	list = fopen(path, "r");
+	free(path);
+	if (!list) {
+		if (errno == ENOENT) {
+			psys_err_set(err, PSYS_ENOENT,
+				     "Package named `%s' is not installed",
+				     dpkgname);
+		} else {
+			psys_err_set(err, PSYS_EINTERNAL,
+				     "Cannot open `%s.list': %s",
+				     dpkgname, strerror(errno));
+		}
+		return -1;
+	}
 
 	ret = 0;
+	while ((len = getline(&line, &size, list)) > 0) {
+		struct md5sums_entry key, **found;
+		psys_flist_t l;
+
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (!len || !strcmp(line, "/."))
+			continue;
+
+		key.path = line;
+		found = tfind(&key, &md5tree, md5sums_entry_cmp);
+
+		l = psys_flist_prepend(*files, line, NULL,
+				       found ? (*found)->md5 : NULL);
+		if (!l) {
+			psys_err_set_nomem(err);
+			ret = -1;
+			break;
+		}
+		*files = l;
+	}
+
+	free(line);
+	fclose(list);
+	return ret;
+}
+
+int dpkg_psys_verify(const char *vendor, const char *name, int mode,
+		     psys_verify_fn fn, void *data, psys_err_t *err)
+{
+	int ret;
+	char *dpkgname;
+	void *md5tree = NULL;
+	psys_flist_t files = NULL;
+
+	/*
+	 * We only need the package's info files for this, so there is no
+	 * need to load (and lock) the package database.
+	 */
+	if (asprintf(&dpkgname, "lsb-%s-%s", vendor, name) < 0) {
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	if (read_md5sums(dpkgname, &md5tree, err) ||
+	    read_file_list(dpkgname, md5tree, &files, err)) {
+		ret = -1;
+		goto out;
+	}
+
+	/* DPKG does not record file modes, so we can't check those */
+	ret = psys_flist_verify(files, mode, fn, data, err);
 out:
-	modstatdb_shutdown();
-	cleanup();
-	return ret;	
+	psys_flist_free(files);
+	tdestroy(md5tree, md5sums_entry_free);
+	free(dpkgname);
+	return ret;
 }
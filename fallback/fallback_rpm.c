@@ -36,9 +36,12 @@
 #include <grp.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 #include <pwd.h>
+#include <search.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -83,6 +86,34 @@ static char *rpm_name(const char *vendor, const char *name)
 		return rpmname;
 }
 
+/*
+ * Checks whether the header belongs to a package registered by psys and,
+ * if so, points *vendor and *name to the package's vendor and name in the
+ * header
+ */
+static int registered_name(Header h, const char **vendor, const char **name)
+{
+	char *hname, *hvendor;
+	size_t vlen;
+
+	if (!headerGetEntry(h, RPMTAG_NAME, NULL, (void **) &hname, NULL) ||
+	    !headerGetEntry(h, RPMTAG_VENDOR, NULL, (void **) &hvendor, NULL))
+		return 0;
+
+	/* Package names are "lsb-<vendor>-<name>" */
+	if (strncmp(hname, "lsb-", 4))
+		return 0;
+	hname += 4;
+	vlen = strlen(hvendor);
+	if (strncmp(hname, hvendor, vlen) || hname[vlen] != '-' ||
+	    !hname[vlen + 1])
+		return 0;
+
+	*vendor = hvendor;
+	*name = hname + vlen + 1;
+	return 1;
+}
+
 static const char *rpm_arch(const char *lsbarch, psys_err_t *err)
 {
 	const char *rpmarch;
@@ -120,27 +151,47 @@ static const char *rpm_arch(const char *lsbarch, psys_err_t *err)
 	return rpmarch;
 }
 
-static rpmts create_transaction_set(psys_err_t *err)
+/*
+ * Parsing the rpmrc and macro files is expensive, so it is only done once
+ * per process. The backend library is never unloaded by libpsys, so the
+ * configuration is kept between calls.
+ */
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+static int config_rc;
+
+static void read_config(void)
+{
+	config_rc = rpmReadConfigFiles(NULL, NULL);
+}
+
+static rpmts create_transaction_set(int dbmode, psys_err_t *err)
 {
+	struct psys_phase phase;
 	rpmts ts;
 
-	if (rpmReadConfigFiles(NULL, NULL)) {
+	psys_phase_begin(&phase, PSYS_PHASE_DB_OPEN);
+
+	pthread_once(&config_once, read_config);
+	if (config_rc) {
 		psys_err_set(err, PSYS_EINTERNAL,
 			     "Cannot read RPM configuration");
-		return NULL;
+		ts = NULL;
+		goto out;
     	}
 
 	ts = rpmtsCreate();
 	if (!ts)
-		return NULL;
+		goto out;
 
-	if (rpmtsOpenDB(ts, O_RDWR)) {
+	if (rpmtsOpenDB(ts, dbmode)) {
 		psys_err_set(err, PSYS_EINTERNAL,
 			     "Cannot open RPM database");
 		rpmtsFree(ts);
-		return NULL;
+		ts = NULL;
 	}
 
+out:
+	psys_phase_end(&phase);
 	return ts;
 }
 
@@ -249,10 +300,24 @@ static char *canonicalize_path(const char *path, psys_err_t *err)
 
 	rpath = realpath(path, NULL);
 	if (!rpath) {
-		psys_err_set(err, PSYS_EINTERNAL,
-			     "Cannot canonicalize path `%s': %s",
-			     path, strerror(errno));
-		return NULL;
+		/*
+		 * Files which do not exist (yet) are compared by the path
+		 * given. Their parent directories may still be symbolic
+		 * links, in which case an existing file reached through
+		 * them is not recognized as the same file.
+		 */
+		if (errno == ENOENT)
+			rpath = strdup(path);
+		if (!rpath) {
+			if (errno == ENOMEM)
+				psys_err_set_nomem(err);
+			else
+				psys_err_set(err, PSYS_EINTERNAL,
+					     "Cannot canonicalize path "
+					     "`%s': %s",
+					     path, strerror(errno));
+			return NULL;
+		}
 	}
 	return rpath;
 }
@@ -323,8 +388,16 @@ static int ensure_dependencies_installed(rpmts ts, psys_pkg_t pkg,
 	return 0;
 }
 
-static int ensure_no_conflict(psys_plist_t p, psys_err_t *err)
+/*
+ * Checks that the file name `p' is neither in use nor owned by an installed
+ * package other than the one with database record offset `self' (UINT_MAX
+ * if the package is not installed yet)
+ */
+static int ensure_no_conflict(rpmts ts, psys_plist_t p, unsigned int self,
+			      psys_err_t *err)
 {
+	rpmdbMatchIterator it;
+	Header h;
 	int rc;
 
 	rc = access(psys_plist_path(p), F_OK);
@@ -340,21 +413,112 @@ static int ensure_no_conflict(psys_plist_t p, psys_err_t *err)
 			     psys_plist_path(p), strerror(errno));
 		return -1;
 	}
-	return 0;
+
+	/*
+	 * The file might be missing, but still belong to an installed
+	 * package. RPM's file index tells us in a single lookup.
+	 */
+	rc = 0;
+	it = rpmtsInitIterator(ts, RPMTAG_BASENAMES, psys_plist_path(p), 0);
+	while (it && (h = rpmdbNextIterator(it))) {
+		char *hname;
+
+		if (rpmdbGetIteratorOffset(it) == self)
+			continue;
+
+		if (!headerGetEntry(h, RPMTAG_NAME, NULL,
+				    (void **) &hname, NULL))
+			hname = "(unknown)";
+		psys_err_set(err, PSYS_ECONFLICT,
+			     "File name `%s' is already used by package `%s'",
+			     psys_plist_path(p), hname);
+		rc = -1;
+		break;
+	}
+	if (it)
+		rpmdbFreeIterator(it);
+	return rc;
 }
 
-static int ensure_no_conflicting_extras(psys_pkg_t pkg, psys_err_t *err) {
+static int ensure_no_conflicting_extras(rpmts ts, psys_pkg_t pkg,
+					psys_err_t *err)
+{
 	psys_plist_t e;
 
 	for (e = psys_pkg_extras(pkg); e; e = psys_plist_next(e)) {
-		if (ensure_no_conflict(e, err))
+		if (ensure_no_conflict(ts, e, UINT_MAX, err))
 			return -1;
 	}
 
 	return 0;
 }
 
-static int ensure_no_new_conflicting_extras(psys_pkg_t pkg, Header installed,
+/*
+ * A set of canonicalized paths, used for comparing extra files against
+ * the files of an installed package in linear time
+ */
+struct path_set {
+	struct hsearch_data table;
+	char **paths;
+	size_t npaths;
+};
+
+static void path_set_free(struct path_set *set)
+{
+	size_t i;
+
+	hdestroy_r(&set->table);
+	for (i = 0; i < set->npaths; i++)
+		free(set->paths[i]);
+	free(set->paths);
+}
+
+static int path_set_init(struct path_set *set, size_t size, psys_err_t *err)
+{
+	memset(set, 0, sizeof(*set));
+
+	set->paths = malloc((size ? size : 1) * sizeof(*set->paths));
+	if (!set->paths || !hcreate_r(size * 2 + 1, &set->table)) {
+		free(set->paths);
+		psys_err_set_nomem(err);
+		return -1;
+	}
+	return 0;
+}
+
+/* Takes over `path' */
+static int path_set_add(struct path_set *set, char *path, psys_err_t *err)
+{
+	ENTRY e, *found;
+
+	e.key = path;
+	e.data = NULL;
+	if (!hsearch_r(e, ENTER, &found, &set->table)) {
+		free(path);
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	/* Duplicate paths leave the existing entry in place */
+	if (found->key != path)
+		free(path);
+	else
+		set->paths[set->npaths++] = path;
+	return 0;
+}
+
+static int path_set_contains(struct path_set *set, char *path)
+{
+	ENTRY e, *found;
+
+	e.key = path;
+	e.data = NULL;
+	return hsearch_r(e, FIND, &found, &set->table) != 0;
+}
+
+static int ensure_no_new_conflicting_extras(rpmts ts, psys_pkg_t pkg,
+					    Header installed,
+					    unsigned int offset,
 					    psys_err_t *err)
 {
 	int ret;
@@ -362,7 +526,13 @@ static int ensure_no_new_conflicting_extras(psys_pkg_t pkg, Header installed,
 	char **dirnames = NULL;
 	int *dirindexes;
 	unsigned int basenames_cnt, dirnames_cnt, dirindexes_cnt;
+	struct path_set installed_paths;
+	bool have_set = false;
 	psys_plist_t p;
+	unsigned int i;
+
+	if (!psys_pkg_extras(pkg))
+		return 0;
 
 	if (!headerGetEntry(installed, RPMTAG_BASENAMES, NULL,
 			    (void **) &basenames, &basenames_cnt)) {
@@ -384,7 +554,7 @@ static int ensure_no_new_conflicting_extras(psys_pkg_t pkg, Header installed,
 			     "Error in headerGetEntry() (RPMTAG_DIRINDEXES)");
 		ret = -1;
 		goto out;
-	}	
+	}
 
 	if (basenames_cnt > dirindexes_cnt) {
 		psys_err_set(err, PSYS_EINTERNAL,
@@ -394,60 +564,68 @@ static int ensure_no_new_conflicting_extras(psys_pkg_t pkg, Header installed,
 		goto out;
 	}
 
+	/* Canonicalize each file of the installed package exactly once */
+	if (path_set_init(&installed_paths, basenames_cnt, err)) {
+		ret = -1;
+		goto out;
+	}
+	have_set = true;
+
+	for (i = 0; i < basenames_cnt; i++) {
+		char path[PATH_MAX];
+		char *cpath;
+
+		if (dirindexes[i] >= dirnames_cnt) {
+			psys_err_set(err, PSYS_EINTERNAL,
+				     "Malformed RPM header: "
+				     "out-of-bounds DIRINDEX");
+			ret = -1;
+			goto out;
+		}
+
+		/* DIRNAMES end with a slash */
+		snprintf(path, PATH_MAX, "%s%s",
+			 dirnames[dirindexes[i]], basenames[i]);
+
+		cpath = canonicalize_path(path, err);
+		if (!cpath || path_set_add(&installed_paths, cpath, err)) {
+			ret = -1;
+			goto out;
+		}
+	}
+
 	for (p = psys_pkg_extras(pkg); p; p = psys_plist_next(p)) {
-		int i;
+		char *cpath;
+		int found;
 
 		/*
 		 * Check if the extra file is already part of the installed
 		 * package's version. If so, everything is fine.
 		 */
-		for (i = 0; i < basenames_cnt; i++) {
-			char path[PATH_MAX];
-			char *cpath1, *cpath2;
-			int diff;
-
-			if (dirindexes[i] >= dirnames_cnt) {
-				psys_err_set(err, PSYS_EINTERNAL,
-					     "Malformed RPM header: "
-					     "out-of-bounds DIRINDEX");
-				ret = -1;
-				goto out;
-			}
-
-			snprintf(path, PATH_MAX, "%s/%s",
-				 dirnames[dirindexes[i]], basenames[i]);
-
-			cpath1 = canonicalize_path(psys_plist_path(p), err);
-			if (!cpath1) {
-				ret = -1;
-				goto out;		
-			}
-			cpath2 = canonicalize_path(path, err);
-			if (!cpath2) {
-				free(cpath1);
-				ret = -1;
-				goto out;		
-			}
-
-			diff = strcmp(cpath1, cpath2);
-			free(cpath1);
-			free(cpath2);
-			if (diff == 0)
-				goto nextfile;
+		cpath = canonicalize_path(psys_plist_path(p), err);
+		if (!cpath) {
+			ret = -1;
+			goto out;
 		}
-		
+		found = path_set_contains(&installed_paths, cpath);
+		free(cpath);
+		if (found)
+			continue;
+
 		/*
 		 * If the extra file is new to this version of the package,
 		 * check that it does not exist yet.
 		 */
-		if (ensure_no_conflict(p, err))
-			return -1;
-nextfile:
-		continue;
+		if (ensure_no_conflict(ts, p, offset, err)) {
+			ret = -1;
+			goto out;
+		}
 	}
 
 	ret = 0;
 out:
+	if (have_set)
+		path_set_free(&installed_paths);
 	if (dirnames)
 		free(dirnames);
 	if (basenames)
@@ -698,6 +876,8 @@ static int add_md5_entry(Header header, psys_flist_t file,
 	/* FILEMD5S */
 	headerAddOrAppendEntry(header, RPMTAG_FILEMD5S,
 			       RPM_STRING_ARRAY_TYPE, &md5, 1);
+
+	psys_free(md5);
 	return 0;
 }
 
@@ -764,14 +944,13 @@ int rpm_psys_announce(psys_pkg_t pkg, psys_err_t *err)
 	rpmts ts;
 	char *rpmname = NULL;
 
-	pkg = psys_pkg_copy(pkg);
+	pkg = psys_pkg_freeze(pkg);
 	if (!pkg) {
 		psys_err_set_nomem(err);
 		return -1;
 	}
-	psys_pkg_assert_valid(pkg);
 
-	ts = create_transaction_set(err);
+	ts = create_transaction_set(O_RDONLY, err);
 	if (!ts) {
 		ret = -1;
 		goto out;
@@ -794,7 +973,7 @@ int rpm_psys_announce(psys_pkg_t pkg, psys_err_t *err)
 		goto out;
 	}
 
-	if (ensure_no_conflicting_extras(pkg, err)) {
+	if (ensure_no_conflicting_extras(ts, pkg, err)) {
 		ret = -1;
 		goto out;
 	}
@@ -819,6 +998,7 @@ static int do_register(rpmts ts, psys_pkg_t pkg, psys_err_t *err)
 	Header header = NULL;
 	psys_flist_t flist = NULL, f;
 	int_32 val_i32;
+	struct psys_phase phase;
 
 	rpmname = rpm_name(psys_pkg_vendor(pkg), psys_pkg_name(pkg));
 	if (!rpmname) {
@@ -843,6 +1023,7 @@ static int do_register(rpmts ts, psys_pkg_t pkg, psys_err_t *err)
 		goto out;
 	}
 
+	psys_phase_begin(&phase, PSYS_PHASE_HEADER);
 	header = headerNew();
 
 	/* NAME */
@@ -878,6 +1059,7 @@ static int do_register(rpmts ts, psys_pkg_t pkg, psys_err_t *err)
 
 	/* Dependencies */
 	add_dependency_entries(header, pkg);
+	psys_phase_end(&phase);
 
 	flist = psys_pkg_flist(pkg, err);
 	if (!flist) {
@@ -893,17 +1075,26 @@ static int do_register(rpmts ts, psys_pkg_t pkg, psys_err_t *err)
 	headerAddEntry(header, RPMTAG_SIZE, RPM_INT32_TYPE, &val_i32, 1);
 
 	/* File metadata */
-	if (add_file_metadata(header, flist, err)) {
+	if (psys_flist_md5sums(flist, err)) {
 		ret = -1;
 		goto out;
 	}
 
+	psys_phase_begin(&phase, PSYS_PHASE_HEADER);
+	ret = add_file_metadata(header, flist, err);
+	psys_phase_end(&phase);
+	if (ret)
+		goto out;
+
 	/* INSTALLTIME */
 	val_i32 = rpmtsGetTid(ts);
 	headerAddEntry(header, RPMTAG_INSTALLTIME, RPM_INT32_TYPE,
 		       &val_i32, 1);
 
-	if (rpmdbAdd(rpmtsGetRdb(ts), rpmtsGetTid(ts), header, ts, NULL)) {
+	psys_phase_begin(&phase, PSYS_PHASE_DB_COMMIT);
+	ret = rpmdbAdd(rpmtsGetRdb(ts), rpmtsGetTid(ts), header, ts, NULL);
+	psys_phase_end(&phase);
+	if (ret) {
 		psys_err_set(err,PSYS_EINTERNAL,
 			     "Adding package to RPM database failed");
 
@@ -927,14 +1118,13 @@ int rpm_psys_register(psys_pkg_t pkg, psys_err_t *err)
 	rpmts ts = NULL;
 	int ret;
 
-	pkg = psys_pkg_copy(pkg);
+	pkg = psys_pkg_freeze(pkg);
 	if (!pkg) {
 		psys_err_set_nomem(err);
 		return -1;
 	}
-	psys_pkg_assert_valid(pkg);
 
-	ts = create_transaction_set(err);
+	ts = create_transaction_set(O_RDWR, err);
 	if (!ts) {
 		psys_pkg_free(pkg);
 		return -1;
@@ -957,14 +1147,13 @@ int rpm_psys_announce_update(psys_pkg_t pkg, psys_err_t *err)
 	unsigned int recoffset;
 	Header header = NULL;
 
-	pkg = psys_pkg_copy(pkg);
+	pkg = psys_pkg_freeze(pkg);
 	if (!pkg) {
 		psys_err_set_nomem(err);
 		return -1;
 	}
-	psys_pkg_assert_valid(pkg);
 
-	ts = create_transaction_set(err);
+	ts = create_transaction_set(O_RDONLY, err);
 	if (!ts) {
 		ret = -1;
 		goto out;
@@ -999,7 +1188,8 @@ int rpm_psys_announce_update(psys_pkg_t pkg, psys_err_t *err)
 		goto out;
 	}
 
-	if (ensure_no_new_conflicting_extras(pkg, header, err)) {
+	if (ensure_no_new_conflicting_extras(ts, pkg, header, recoffset,
+					     err)) {
 		ret = -1;
 		goto out;
 	}
@@ -1027,20 +1217,13 @@ int rpm_psys_register_update(psys_pkg_t pkg, psys_err_t *err)
 	unsigned int recoffset;
 	Header header = NULL;
 
-	pkg = psys_pkg_copy(pkg);
-	if (!pkg) {
-		psys_err_set_nomem(err);
-		return -1;
-	}
-	psys_pkg_assert_valid(pkg);
-	pkg = psys_pkg_copy(pkg);
+	pkg = psys_pkg_freeze(pkg);
 	if (!pkg) {
 		psys_err_set_nomem(err);
 		return -1;
 	}
-	psys_pkg_assert_valid(pkg);
 
-	ts = create_transaction_set(err);
+	ts = create_transaction_set(O_RDWR, err);
 	if (!ts) {
 		ret = -1;
 		goto out;
@@ -1102,7 +1285,7 @@ int rpm_psys_unannounce(const char *vendor, const char *name,
 	char *rpmname;
 	unsigned int recoffset;
 
-	ts = create_transaction_set(err);
+	ts = create_transaction_set(O_RDONLY, err);
 	if (!ts)
 		return -1;
 
@@ -1121,33 +1304,449 @@ int rpm_psys_unannounce(const char *vendor, const char *name,
 
 /*** psys_unregister() ***************************************************/
 
+struct offset_list {
+	unsigned int *offsets;
+	size_t count;
+	size_t size;
+};
+
+/*
+ * Adds the database offsets of all records of the package to `list', in a
+ * single pass over the Name index. A package can have more than one record
+ * if it was registered for several architectures or if an update failed
+ * half-way.
+ */
+static int collect_by_name(rpmts ts, const char *name,
+			   struct offset_list *list, psys_err_t *err)
+{
+	rpmdbMatchIterator it;
+	size_t count;
+
+	count = list->count;
+	it = rpmtsInitIterator(ts, RPMTAG_NAME, name, 0);
+	while (it && rpmdbNextIterator(it)) {
+		if (list->count == list->size) {
+			unsigned int *offsets;
+			size_t size;
+
+			size = list->size ? list->size * 2 : 8;
+			offsets = realloc(list->offsets,
+					  size * sizeof(*offsets));
+			if (!offsets) {
+				psys_err_set_nomem(err);
+				rpmdbFreeIterator(it);
+				return -1;
+			}
+			list->offsets = offsets;
+			list->size = size;
+		}
+		list->offsets[list->count++] = rpmdbGetIteratorOffset(it);
+	}
+	if (it)
+		rpmdbFreeIterator(it);
+
+	if (list->count == count) {
+		psys_err_set(err, PSYS_ENOENT,
+			     "No package named `%s' is installed", name);
+		return -1;
+	}
+	return 0;
+}
+
+static int offset_cmp(const void *a, const void *b)
+{
+	unsigned int oa = *(const unsigned int *) a;
+	unsigned int ob = *(const unsigned int *) b;
+
+	return (oa > ob) - (oa < ob);
+}
+
+/*
+ * Sorts the offsets in `list' and drops duplicates, which result from a
+ * package being named more than once
+ */
+static void offset_list_uniq(struct offset_list *list)
+{
+	size_t i, n;
+
+	if (!list->count)
+		return;
+
+	qsort(list->offsets, list->count, sizeof(*list->offsets),
+	      offset_cmp);
+	n = 1;
+	for (i = 1; i < list->count; i++) {
+		if (list->offsets[i] != list->offsets[n - 1])
+			list->offsets[n++] = list->offsets[i];
+	}
+	list->count = n;
+}
+
+int rpm_psys_unregister_many(const char * const *vendors,
+			     const char * const *names, size_t count,
+			     psys_err_t *err)
+{
+	struct offset_list list = {NULL, 0, 0};
+	struct psys_phase phase;
+	rpmts ts;
+	size_t i;
+	int ret;
+
+	ts = create_transaction_set(O_RDWR, err);
+	if (!ts)
+		return -1;
+
+	/*
+	 * Look up all records before removing any, so that nothing is
+	 * removed if one of the packages is not installed (and because
+	 * the records can't be removed while an iterator is open)
+	 */
+	for (i = 0; i < count; i++) {
+		char *rpmname;
+
+		rpmname = rpm_name(vendors[i], names[i]);
+		if (!rpmname) {
+			psys_err_set_nomem(err);
+			ret = -1;
+			goto out;
+		}
+
+		ret = collect_by_name(ts, rpmname, &list, err);
+		free(rpmname);
+		if (ret)
+			goto out;
+	}
+	offset_list_uniq(&list);
+
+	psys_phase_begin(&phase, PSYS_PHASE_DB_COMMIT);
+	for (i = 0; i < list.count; i++) {
+		if (rpmdbRemove(rpmtsGetRdb(ts), 0, list.offsets[i], ts,
+				NULL)) {
+			psys_err_set(err, PSYS_EINTERNAL,
+				     "Cannot remove record %u from the RPM "
+				     "database", list.offsets[i]);
+			ret = -1;
+			break;
+		}
+	}
+	psys_phase_end(&phase);
+	if (i < list.count)
+		goto out;
+
+	ret = 0;
+out:
+	free(list.offsets);
+	rpmtsFree(ts);
+	return ret;
+}
+
 int rpm_psys_unregister(const char *vendor, const char *name,
 			psys_err_t *err)
 {
-	char *rpmname;
+	return rpm_psys_unregister_many(&vendor, &name, 1, err);
+}
+
+/*** psys_query() *************************************************************/
+
+int rpm_psys_query(const char *vendor, const char *name, char **version,
+		   psys_err_t *err)
+{
+	int ret;
 	rpmts ts;
+	char *rpmname = NULL;
+	char *rpmversion;
+	Header header = NULL;
 
-	ts = create_transaction_set(err);
+	ts = create_transaction_set(O_RDONLY, err);
 	if (!ts)
 		return -1;
 
 	rpmname = rpm_name(vendor, name);
 	if (!rpmname) {
 		psys_err_set_nomem(err);
-		rpmtsFree(ts);
+		ret = -1;
+		goto out;
+	}
+
+	/* This is a lookup in the RPM database's Name index */
+	if (find_by_name(ts, rpmname, NULL, &header, err) == UINT_MAX) {
+		ret = -1;
+		goto out;
+	}
+
+	if (!headerGetEntry(header, RPMTAG_VERSION, NULL,
+			    (void **) &rpmversion, NULL)) {
+		psys_err_set(err, PSYS_EINTERNAL,
+			     "Error in headerGetEntry() (RPMTAG_VERSION)");
+		ret = -1;
+		goto out;
+	}
+
+	*version = strdup(rpmversion);
+	if (!*version) {
+		psys_err_set_nomem(err);
+		ret = -1;
+		goto out;
+	}
+
+	ret = 0;
+out:
+	if (header)
+		headerFree(header);
+	if (rpmname)
+		free(rpmname);
+	rpmtsFree(ts);
+	return ret;
+}
+
+/*** psys_owner_of() **********************************************************/
+
+int rpm_psys_owner_of(const char *path, char **vendor, char **name,
+		      psys_err_t *err)
+{
+	int ret;
+	rpmts ts;
+	rpmdbMatchIterator it;
+	Header h;
+
+	ts = create_transaction_set(O_RDONLY, err);
+	if (!ts)
 		return -1;
+
+	/* RPM already maintains an index of installed files */
+	it = rpmtsInitIterator(ts, RPMTAG_BASENAMES, path, 0);
+	ret = 1;
+	while (it && (h = rpmdbNextIterator(it)) != NULL) {
+		const char *hvendor, *hname;
+
+		if (!registered_name(h, &hvendor, &hname))
+			continue;
+
+		*vendor = strdup(hvendor);
+		*name = strdup(hname);
+		if (!*vendor || !*name) {
+			free(*vendor);
+			free(*name);
+			psys_err_set_nomem(err);
+			ret = -1;
+		} else {
+			ret = 0;
+		}
+		break;
+	}
+
+	if (ret > 0) {
+		psys_err_set(err, PSYS_ENOENT,
+			     "File `%s' does not belong to any package "
+			     "registered with psys", path);
+		ret = -1;
+	}
+
+	if (it)
+		rpmdbFreeIterator(it);
+	rpmtsFree(ts);
+	return ret;
+}
+
+/*** psys_list_packages() *****************************************************/
+
+struct rpm_list {
+	rpmts ts;
+	rpmdbMatchIterator it;
+};
+
+void *rpm_psys_list_open(psys_err_t *err)
+{
+	struct rpm_list *l;
+
+	l = malloc(sizeof(*l));
+	if (!l) {
+		psys_err_set_nomem(err);
+		return NULL;
 	}
 
-	while (1) {
-		unsigned int recoffset;
+	l->ts = create_transaction_set(O_RDONLY, err);
+	if (!l->ts) {
+		free(l);
+		return NULL;
+	}
 
-		recoffset = find_by_name(ts, rpmname, NULL, NULL, err);
-		if (recoffset == UINT_MAX) {
-			free(rpmname);
-			rpmtsFree(ts);
-			return 0;
+	/*
+	 * Walk the Name index, letting RPM skip all packages whose name
+	 * does not start with "lsb-" before we see their headers
+	 */
+	l->it = rpmtsInitIterator(l->ts, RPMTAG_NAME, NULL, 0);
+	if (!l->it ||
+	    rpmdbSetIteratorRE(l->it, RPMTAG_NAME, RPMMIRE_GLOB, "lsb-*")) {
+		psys_err_set(err, PSYS_EINTERNAL,
+			     "Could not create package database iterator");
+		if (l->it)
+			rpmdbFreeIterator(l->it);
+		rpmtsFree(l->ts);
+		free(l);
+		return NULL;
+	}
+
+	return l;
+}
+
+int rpm_psys_list_next(void *list, const char **vendor, const char **name,
+		       const char **version, const char **arch,
+		       psys_err_t *err)
+{
+	struct rpm_list *l = list;
+	Header h;
+
+	/* The returned header (and its strings) is valid until the next call */
+	while ((h = rpmdbNextIterator(l->it)) != NULL) {
+		if (registered_name(h, vendor, name) &&
+		    headerGetEntry(h, RPMTAG_VERSION, NULL,
+				   (void **) version, NULL) &&
+		    headerGetEntry(h, RPMTAG_ARCH, NULL,
+				   (void **) arch, NULL))
+			return 1;
+	}
+
+	return 0;
+}
+
+void rpm_psys_list_close(void *list)
+{
+	struct rpm_list *l = list;
+
+	rpmdbFreeIterator(l->it);
+	rpmtsFree(l->ts);
+	free(l);
+}
+
+/*** psys_verify() ************************************************************/
+
+static int header_file_list(Header header, psys_flist_t *files,
+			    psys_err_t *err)
+{
+	int ret;
+	char **basenames = NULL;
+	char **dirnames = NULL;
+	char **md5s = NULL;
+	int_32 *dirindexes, *sizes = NULL;
+	int_16 *modes = NULL;
+	unsigned int basenames_cnt, dirnames_cnt, dirindexes_cnt;
+	unsigned int md5s_cnt = 0, sizes_cnt = 0, modes_cnt = 0;
+	int i;
+
+	/* A package without BASENAMES simply has no files */
+	if (!headerGetEntry(header, RPMTAG_BASENAMES, NULL,
+			    (void **) &basenames, &basenames_cnt))
+		return 0;
+
+	if (!headerGetEntry(header, RPMTAG_DIRNAMES, NULL,
+			    (void **) &dirnames, &dirnames_cnt) ||
+	    !headerGetEntry(header, RPMTAG_DIRINDEXES, NULL,
+			    (void **) &dirindexes, &dirindexes_cnt) ||
+	    basenames_cnt > dirindexes_cnt) {
+		psys_err_set(err, PSYS_EINTERNAL,
+			     "Malformed RPM header: inconsistent file names");
+		ret = -1;
+		goto out;
+	}
+
+	/* These are optional; we just check less without them */
+	headerGetEntry(header, RPMTAG_FILEMD5S, NULL, (void **) &md5s,
+		       &md5s_cnt);
+	headerGetEntry(header, RPMTAG_FILESIZES, NULL, (void **) &sizes,
+		       &sizes_cnt);
+	headerGetEntry(header, RPMTAG_FILEMODES, NULL, (void **) &modes,
+		       &modes_cnt);
+
+	/* Go backwards so that the list ends up in header order */
+	for (i = basenames_cnt - 1; i >= 0; i--) {
+		char *path;
+		struct stat st, *stp;
+		psys_flist_t l;
+
+		if (dirindexes[i] >= dirnames_cnt) {
+			psys_err_set(err, PSYS_EINTERNAL,
+				     "Malformed RPM header: "
+				     "out-of-bounds DIRINDEX");
+			ret = -1;
+			goto out;
+		}
+
+		if (asprintf(&path, "%s%s", dirnames[dirindexes[i]],
+			     basenames[i]) < 0) {
+			psys_err_set_nomem(err);
+			ret = -1;
+			goto out;
+		}
+
+		stp = NULL;
+		if (i < modes_cnt) {
+			memset(&st, 0, sizeof(st));
+			st.st_mode = (unsigned short) modes[i];
+			if (i < sizes_cnt)
+				st.st_size = (unsigned int) sizes[i];
+			stp = &st;
+		}
+
+		l = psys_flist_prepend(*files, path, stp,
+				       (i < md5s_cnt) ? md5s[i] : NULL);
+		free(path);
+		if (!l) {
+			psys_err_set_nomem(err);
+			ret = -1;
+			goto out;
 		}
-		rpmdbRemove(rpmtsGetRdb(ts), 0, recoffset, ts, NULL);
+		*files = l;
 	}
+
+	ret = 0;
+out:
+	if (md5s)
+		free(md5s);
+	if (dirnames)
+		free(dirnames);
+	if (basenames)
+		free(basenames);
+	return ret;
 }
 
+int rpm_psys_verify(const char *vendor, const char *name, int mode,
+		    psys_verify_fn fn, void *data, psys_err_t *err)
+{
+	int ret;
+	rpmts ts;
+	char *rpmname = NULL;
+	Header header = NULL;
+	psys_flist_t files = NULL;
+
+	ts = create_transaction_set(O_RDONLY, err);
+	if (!ts)
+		return -1;
+
+	rpmname = rpm_name(vendor, name);
+	if (!rpmname) {
+		psys_err_set_nomem(err);
+		ret = -1;
+		goto out;
+	}
+
+	if (find_by_name(ts, rpmname, NULL, &header, err) == UINT_MAX) {
+		ret = -1;
+		goto out;
+	}
+
+	if (header_file_list(header, &files, err)) {
+		ret = -1;
+		goto out;
+	}
+
+	ret = psys_flist_verify(files, mode, fn, data, err);
+out:
+	psys_flist_free(files);
+	if (header)
+		headerFree(header);
+	if (rpmname)
+		free(rpmname);
+	rpmtsFree(ts);
+	return ret;
+}
@@ -29,6 +29,7 @@
 
 #include <assert.h>
 #include <dlfcn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,9 +37,17 @@
 #include "psys.h"
 #include "psys_impl.h"
 #include "psys_private.h"
+#include "psys_probes.h"
 
 static const char *IMPL_LIB = "libpsys_impl.so";
 
+/*
+ * Once loaded, the backend stays loaded (RTLD_NODELETE) so that it can
+ * keep expensive state, like a parsed package manager configuration,
+ * from one call to the next
+ */
+static const int IMPL_FLAGS = RTLD_LAZY | RTLD_GLOBAL | RTLD_NODELETE;
+
 /* struct _psys_err is defined in <psys_impl.h> */
 
 struct _psys_tlist {
@@ -52,6 +61,34 @@ struct _psys_plist {
 	char *path;
 };
 
+/*
+ * Memory for the strings and list elements of a package object is taken
+ * from a bump arena, a chain of blocks that are only freed together with
+ * the package. The first block is part of the package object itself.
+ */
+struct arena_block {
+	struct arena_block *next;
+};
+
+struct arena {
+	struct arena_block *blocks;
+	char *pos;
+	char *end;
+	size_t last_size;
+};
+
+/*
+ * A translation list together with an open-addressing hash index of its
+ * elements by locale, so that replacing a translation does not need to
+ * scan the list
+ */
+struct tlist_table {
+	psys_tlist_t list;
+	psys_tlist_t *slots;
+	size_t nslots;
+	size_t count;
+};
+
 struct _psys_pkg {
 	/* Data directory */
 	char *dir;
@@ -63,12 +100,38 @@ struct _psys_pkg {
 	char *lsbversion;
 	char *arch;
 
+	/* Binary comparison key of the version (see psys_verkey_encode()) */
+	unsigned char *verkey;
+	size_t verkey_len;
+
 	/* Optional metadata */
-	psys_tlist_t summary;
-	psys_tlist_t description;
+	struct tlist_table summary;
+	struct tlist_table description;
 
 	/* Extra files */
 	psys_plist_t extras;
+
+	/* References to a frozen package, or 0 if it can still be changed */
+	int refs;
+
+	/* Memory for all of the above, starting with the first block */
+	struct arena arena;
+	char arena_data[];
+};
+
+struct _psys_pkg_iter {
+	/* Backend library and list handle */
+	void *impl;
+	void *list;
+	int (*next)(void *, const char **, const char **, const char **,
+		    const char **, psys_err_t *);
+	void (*close)(void *);
+
+	/* Current package (owned by the backend) */
+	const char *vendor;
+	const char *name;
+	const char *version;
+	const char *arch;
 };
 
 /*** Handling errors **********************************************************/
@@ -87,93 +150,258 @@ const char *psys_err_msg(psys_err_t err)
 
 void psys_err_free(psys_err_t err)
 {
-	if (err && err->code != PSYS_ENOMEM) {
+	if (err && !err->shared) {
 		if (err->msg)
-			free(err->msg);
-		free(err);
+			psys_free(err->msg);
+		psys_free(err);
 	}
 }
 
-/*** Traversing translation lists *********************************************/
+/*** Allocating package memory ************************************************/
 
-static void tlist_free(psys_tlist_t list)
-{
-	if (list) {
-		psys_tlist_t l;
-		psys_tlist_t next;
-
-		l = list;
-		while (l) {
-			if (l->locale)
-				free(l->locale);
-			if (l->value)
-				free(l->value);
-			next = l->next;
-			free(l);
-			l = next;
-		}
+/* Space for optional metadata in the first arena block of a package */
+#define ARENA_INITIAL_SPARE 512
+
+/* Minimum size of additional arena blocks */
+#define ARENA_MIN_BLOCK 4096
+
+static void arena_init(struct arena *arena, char *data, size_t size)
+{
+	arena->blocks = NULL;
+	arena->pos = data;
+	arena->end = data + size;
+	arena->last_size = size;
+}
+
+static void arena_free(struct arena *arena)
+{
+	struct arena_block *block, *next;
+
+	for (block = arena->blocks; block; block = next) {
+		next = block->next;
+		psys_free(block);
 	}
 }
 
-static psys_tlist_t tlist_add(psys_tlist_t list, const char *locale,
-			      const char *trans)
+static void *arena_alloc(struct arena *arena, size_t size, size_t align)
+{
+	uintptr_t pos;
+
+	pos = ((uintptr_t) arena->pos + align - 1) & ~(uintptr_t) (align - 1);
+	if (pos + size > (uintptr_t) arena->end) {
+		struct arena_block *block;
+		size_t block_size;
+
+		/*
+		 * Double the block size each time, so that the number of
+		 * blocks only grows logarithmically with the package size
+		 */
+		block_size = 2 * arena->last_size;
+		if (block_size < ARENA_MIN_BLOCK)
+			block_size = ARENA_MIN_BLOCK;
+		if (block_size < size + align)
+			block_size = size + align;
+
+		block = psys_malloc(sizeof(*block) + block_size);
+		if (!block)
+			return NULL;
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->pos = (char *) (block + 1);
+		arena->end = arena->pos + block_size;
+		arena->last_size = block_size;
+
+		pos = ((uintptr_t) arena->pos + align - 1) &
+			~(uintptr_t) (align - 1);
+	}
+
+	arena->pos = (char *) (pos + size);
+	return (void *) pos;
+}
+
+/*
+ * Makes sure that the next allocations of up to size bytes in total are
+ * taken from a single block
+ */
+static int arena_reserve(struct arena *arena, size_t size)
+{
+	char *pos;
+
+	if (size <= (size_t) (arena->end - arena->pos))
+		return 0;
+
+	pos = arena_alloc(arena, size, 1);
+	if (!pos)
+		return -1;
+	arena->pos = pos;
+	return 0;
+}
+
+static char *arena_strdup(struct arena *arena, const char *str)
+{
+	size_t len;
+	char *dup;
+
+	len = strlen(str) + 1;
+	dup = arena_alloc(arena, len, 1);
+	if (dup)
+		memcpy(dup, str, len);
+	return dup;
+}
+
+#define arena_new(arena, type) \
+	((type *) arena_alloc((arena), sizeof(type), __alignof__(type)))
+
+/*** Traversing translation lists *********************************************/
+
+/* Minimum number of hash index slots of a translation list */
+#define TLIST_MIN_SLOTS 8
+
+static const char *tlist_normalize_locale(const char *locale)
+{
+	return strcmp(locale, "POSIX") ? locale : "C";
+}
+
+static size_t tlist_hash(const char *locale)
+{
+	const unsigned char *c;
+	size_t hash;
+
+	/* FNV-1a */
+	hash = 2166136261u;
+	for (c = (const unsigned char *) locale; *c; c++)
+		hash = (hash ^ *c) * 16777619u;
+	return hash;
+}
+
+/*
+ * Returns the index slot of the element for the passed locale, or the
+ * empty slot where it belongs
+ */
+static psys_tlist_t *tlist_slot(struct tlist_table *table,
+				const char *locale)
+{
+	size_t i, mask;
+
+	mask = table->nslots - 1;
+	i = tlist_hash(locale) & mask;
+	while (table->slots[i] && strcmp(table->slots[i]->locale, locale))
+		i = (i + 1) & mask;
+	return &table->slots[i];
+}
+
+/*
+ * Grows the hash index so that count more elements can be added while
+ * keeping it at most half full. Old slot arrays stay in the arena, but
+ * as the index doubles in size, they take less space than the new one.
+ */
+static int tlist_reserve(struct arena *arena, struct tlist_table *table,
+			 size_t count)
 {
+	psys_tlist_t *slots, l;
+	size_t nslots;
+
+	nslots = table->nslots ? table->nslots : TLIST_MIN_SLOTS;
+	while (nslots < 2 * (table->count + count))
+		nslots *= 2;
+	if (nslots == table->nslots)
+		return 0;
+
+	slots = arena_alloc(arena, nslots * sizeof(*slots),
+			    __alignof__(*slots));
+	if (!slots)
+		return -1;
+	memset(slots, 0, nslots * sizeof(*slots));
+
+	table->slots = slots;
+	table->nslots = nslots;
+	for (l = table->list; l; l = l->next)
+		*tlist_slot(table, l->locale) = l;
+	return 0;
+}
+
+static int tlist_add(struct arena *arena, struct tlist_table *table,
+		     const char *locale, const char *trans)
+{
+	psys_tlist_t elem, *slot;
+
 	assert(locale != NULL);
 	assert(trans != NULL);
 
-	if (!strcmp(locale, "POSIX"))
-		locale = "C";
+	locale = tlist_normalize_locale(locale);
+	if (tlist_reserve(arena, table, 1) < 0)
+		return -1;
 
 	/*
 	 * Is there already a tranlation for the passed locale in the list?
-	 * If yes, overwrite
+	 * If yes, overwrite (the old value stays in the arena until the
+	 * package is freed)
 	 */
-	if (list) {
-		psys_tlist_t l;
-
-		for (l = list; l; l = psys_tlist_next(l)) {
-			if (!strcmp(l->locale, locale)) {
-				char *trans_dup;
-				trans_dup = strdup(trans);
-				if (!trans_dup) {
-					return NULL;
-				} else {
-					assert(l->value != NULL);
-					free(l->value);
-					l->value = trans_dup;
-					return list;
-				}
-			}
-		}	
+	slot = tlist_slot(table, locale);
+	if (*slot) {
+		char *trans_dup;
+
+		trans_dup = arena_strdup(arena, trans);
+		if (!trans_dup)
+			return -1;
+		(*slot)->value = trans_dup;
+		return 0;
 	}
 
 	/* If not, create a new element */
-	{
-		psys_tlist_t elem;
+	elem = arena_new(arena, struct _psys_tlist);
+	if (!elem)
+		return -1;
 
-		elem = malloc(sizeof(*elem));
-		if (!elem)
-			return NULL;
+	elem->locale = arena_strdup(arena, locale);
+	elem->value = arena_strdup(arena, trans);
+	if (!elem->locale || !elem->value)
+		return -1;
 
-		elem->locale = strdup(locale);
-		elem->value = strdup(trans);
-		if (!elem->locale || !elem->value) {
-			tlist_free(elem);
-			return NULL;
-		}
+	/*
+	 * Prepend because this is the most efficient, and the order of a
+	 * translation list's elements is not defined anyway. The only
+	 * exception is the "C" translation, which is always kept first so
+	 * that the backends can find it right away.
+	 */
+	if (table->list && !strcmp(table->list->locale, "C") &&
+	    strcmp(locale, "C")) {
+		elem->next = table->list->next;
+		table->list->next = elem;
+	} else {
+		elem->next = table->list;
+		table->list = elem;
+	}
+
+	*slot = elem;
+	table->count++;
+	return 0;
+}
 
-		if (list)
-			/*
-			 * Prepend because this is the most efficient, and
-			 * the order of a translation list's elements is not
-			 * defined anyway
-			 */
-			elem->next = list;
-		else
-			elem->next = NULL;
-
-		return elem;
+static int tlist_add_many(struct arena *arena, struct tlist_table *table,
+			  const char * const *locales,
+			  const char * const *values, size_t count)
+{
+	size_t i, size;
+
+	/* Size the index and the arena for all translations at once */
+	size = count * (sizeof(struct _psys_tlist) +
+			__alignof__(struct _psys_tlist));
+	for (i = 0; i < count; i++) {
+		assert(locales[i] != NULL);
+		assert(values[i] != NULL);
+		size += strlen(locales[i]) + strlen(values[i]) + 2;
 	}
+
+	if (tlist_reserve(arena, table, count) < 0 ||
+	    arena_reserve(arena, size) < 0)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		if (tlist_add(arena, table, locales[i], values[i]) < 0)
+			return -1;
+	}
+	return 0;
 }
 
 const char *psys_tlist_locale(psys_tlist_t elem)
@@ -196,47 +424,29 @@ psys_tlist_t psys_tlist_next(psys_tlist_t elem)
 
 /*** Traversing path lists ****************************************************/
 
-static void plist_free(psys_plist_t list)
-{
-	if (list) {
-		psys_plist_t l;
-		psys_plist_t next;
-
-		l = list;
-		while (l) {
-			if (l->path)
-				free(l->path);
-			next = l->next;
-			free(l);
-			l = next;
-		}
-	}
-}
-
-static psys_plist_t plist_add(psys_plist_t list, const char *path)
+static psys_plist_t plist_add(struct arena *arena, psys_plist_t list,
+			      const char *path)
 {
 	psys_plist_t elem;
+	size_t len;
+	int canonical;
 
 	assert (path != NULL);
-	assert (path[0] == '/' && "Path must be absolute");
-	assert (psys_path_is_canonical(path));
+	canonical = psys_path_scan(path, &len);
+	assert (canonical && "Path must be absolute and canonical");
 
-	elem = malloc(sizeof(*elem));
+	/*
+	 * As canonical paths have no trailing slashes, the path can be
+	 * stored as it is
+	 */
+	elem = arena_new(arena, struct _psys_plist);
 	if (!elem)
 		return NULL;
 
-	elem->path = strdup(path);
-	if (!elem->path) {
-		plist_free(elem);
+	elem->path = arena_alloc(arena, len + 1, 1);
+	if (!elem->path)
 		return NULL;
-	}
-
-	/*
-	 * Strip trailing slashes so that we get completely
-	 * normalized paths
-	 */
-	if (elem->path[strlen(elem->path) - 1] == '/')
-		elem->path[strlen(elem->path) - 1] = '\0';
+	memcpy(elem->path, path, len + 1);
 
 	if (list)
 		/*
@@ -262,6 +472,61 @@ psys_plist_t psys_plist_next(psys_plist_t elem)
 
 /*** Creating and freeing package objects *************************************/
 
+/*
+ * Allocates a package object with the passed core metadata and room for
+ * spare bytes of optional metadata in the first arena block
+ */
+static psys_pkg_t pkg_alloc(const char *vendor, const char *name,
+			    const char *version, const char *lsbversion,
+			    const char *arch, size_t spare)
+{
+	psys_pkg_t pkg;
+	size_t vendor_len, name_len, size;
+
+	/*
+	 * Allocate the package object together with a first arena block
+	 * large enough for the core metadata, the data directory and the
+	 * version key
+	 */
+	vendor_len = strlen(vendor);
+	name_len = strlen(name);
+	size = 2 * (vendor_len + name_len + 1) + sizeof("/opt//") +
+	       strlen(version) + 1 + PSYS_VERKEY_MAX(strlen(version)) +
+	       strlen(lsbversion) + 1 + strlen(arch) + 1 + spare;
+
+	pkg = psys_malloc(sizeof(*pkg) + size);
+	if (!pkg)
+		return NULL;
+	arena_init(&pkg->arena, pkg->arena_data, size);
+
+	pkg->dir = arena_alloc(&pkg->arena,
+			       vendor_len + name_len + sizeof("/opt//"), 1);
+	sprintf(pkg->dir, "/opt/%s/%s", vendor, name);
+
+	pkg->vendor = arena_strdup(&pkg->arena, vendor);
+	pkg->name = arena_strdup(&pkg->arena, name);
+	pkg->version = arena_strdup(&pkg->arena, version);
+	pkg->lsbversion = arena_strdup(&pkg->arena, lsbversion);
+	pkg->arch = arena_strdup(&pkg->arena, arch);
+
+	/*
+	 * Encode the version only once, as the backends compare it to the
+	 * installed version on every registration and update
+	 */
+	pkg->verkey = arena_alloc(&pkg->arena,
+				  PSYS_VERKEY_MAX(strlen(version)), 1);
+	pkg->verkey_len = psys_verkey_encode(version, pkg->verkey,
+					     PSYS_VERKEY_MAX(strlen(version)));
+	assert(pkg->verkey_len > 0);
+
+	memset(&pkg->summary, 0, sizeof(pkg->summary));
+	memset(&pkg->description, 0, sizeof(pkg->description));
+	pkg->extras = NULL;
+	pkg->refs = 0;
+
+	return pkg;
+}
+
 psys_pkg_t psys_pkg_new(const char *vendor, const char *name,
 			const char *version, const char *lsbversion,
 			const char *arch)
@@ -274,56 +539,133 @@ psys_pkg_t psys_pkg_new(const char *vendor, const char *name,
 	assert(lsbversion != NULL);
 	assert(arch != NULL);
 
-	pkg = malloc(sizeof(*pkg));
+	pkg = pkg_alloc(vendor, name, version, lsbversion, arch,
+			ARENA_INITIAL_SPARE);
 	if (!pkg)
 		return NULL;
 
-	if (asprintf(&pkg->dir, "/opt/%s/%s", vendor, name) < 0) {
-		psys_pkg_free(pkg);
-		return NULL;
+	psys_pkg_assert_valid(pkg);
+	return pkg;
+}
+
+void psys_pkg_free(psys_pkg_t pkg)
+{
+	if (pkg) {
+		/* A frozen package is only freed with its last reference */
+		if (__atomic_load_n(&pkg->refs, __ATOMIC_RELAXED) &&
+		    __atomic_sub_fetch(&pkg->refs, 1, __ATOMIC_ACQ_REL))
+			return;
+
+		arena_free(&pkg->arena);
+		psys_free(pkg);
 	}
+}
 
-	pkg->vendor = strdup(vendor);
-	pkg->name = strdup(name);
-	pkg->version = strdup(version);
-	pkg->lsbversion = strdup(lsbversion);
-	pkg->arch = strdup(arch);
-	if (!pkg->vendor || !pkg->name || !pkg->version || !pkg->lsbversion ||
-	    !pkg->arch) {
-		psys_pkg_free(pkg);
-		return NULL;
+/*** Freezing package objects *************************************************/
+
+/* Size of a string in an arena, including the worst-case alignment */
+#define ARENA_STR_SIZE(str) (strlen(str) + 1)
+#define ARENA_NODE_SIZE(type) (sizeof(type) + __alignof__(type) - 1)
+
+static size_t tlist_size(psys_tlist_t list)
+{
+	psys_tlist_t l;
+	size_t size;
+
+	size = 0;
+	for (l = list; l; l = l->next)
+		size += ARENA_NODE_SIZE(struct _psys_tlist) +
+			ARENA_STR_SIZE(l->locale) + ARENA_STR_SIZE(l->value);
+	return size;
+}
+
+static psys_tlist_t tlist_copy(struct arena *arena, psys_tlist_t list)
+{
+	psys_tlist_t copy, *tail, l;
+
+	/*
+	 * The list is known to have no duplicate locales, so the elements
+	 * are appended as they are, keeping their order
+	 */
+	copy = NULL;
+	tail = &copy;
+	for (l = list; l; l = l->next) {
+		psys_tlist_t elem;
+
+		elem = arena_new(arena, struct _psys_tlist);
+		elem->locale = arena_strdup(arena, l->locale);
+		elem->value = arena_strdup(arena, l->value);
+		elem->next = NULL;
+		*tail = elem;
+		tail = &elem->next;
 	}
+	return copy;
+}
 
-	pkg->summary = NULL;
-	pkg->description = NULL;
-	pkg->extras = NULL;
+static size_t plist_size(psys_plist_t list)
+{
+	psys_plist_t l;
+	size_t size;
+
+	size = 0;
+	for (l = list; l; l = l->next)
+		size += ARENA_NODE_SIZE(struct _psys_plist) +
+			ARENA_STR_SIZE(l->path);
+	return size;
+}
 
-	psys_pkg_assert_valid(pkg);
-	return pkg;
+static psys_plist_t plist_copy(struct arena *arena, psys_plist_t list)
+{
+	psys_plist_t copy, *tail, l;
+
+	copy = NULL;
+	tail = &copy;
+	for (l = list; l; l = l->next) {
+		psys_plist_t elem;
+
+		elem = arena_new(arena, struct _psys_plist);
+		elem->path = arena_strdup(arena, l->path);
+		elem->next = NULL;
+		*tail = elem;
+		tail = &elem->next;
+	}
+	return copy;
 }
 
-void psys_pkg_free(psys_pkg_t pkg)
+psys_pkg_t psys_pkg_freeze(psys_pkg_t pkg)
 {
-	if (pkg) {
-		if (pkg->dir)
-			free(pkg->dir);
-		if (pkg->vendor)
-			free(pkg->vendor);
-		if (pkg->name)
-			free(pkg->name);
-		if (pkg->version)
-			free(pkg->version);
-		if (pkg->lsbversion)
-			free(pkg->lsbversion);
-		if (pkg->arch)
-			free(pkg->arch);
-
-		tlist_free(pkg->summary);
-		tlist_free(pkg->description);
-		plist_free(pkg->extras);
-
-		free(pkg);
+	psys_pkg_t frozen;
+
+	assert(pkg != NULL);
+
+	/*
+	 * Frozen packages never change, so a new reference is as good as
+	 * a copy. Otherwise, a frozen copy is made in a single allocation;
+	 * as the copied lists are sized up front, none of the arena
+	 * allocations below can fail.
+	 */
+	if (__atomic_load_n(&pkg->refs, __ATOMIC_RELAXED)) {
+		__atomic_add_fetch(&pkg->refs, 1, __ATOMIC_RELAXED);
+		return pkg;
 	}
+
+	frozen = pkg_alloc(pkg->vendor, pkg->name, pkg->version,
+			   pkg->lsbversion, pkg->arch,
+			   tlist_size(pkg->summary.list) +
+			   tlist_size(pkg->description.list) +
+			   plist_size(pkg->extras));
+	if (!frozen)
+		return NULL;
+
+	/* Frozen packages do not need a hash index */
+	frozen->summary.list = tlist_copy(&frozen->arena, pkg->summary.list);
+	frozen->description.list = tlist_copy(&frozen->arena,
+					      pkg->description.list);
+	frozen->extras = plist_copy(&frozen->arena, pkg->extras);
+	frozen->refs = 1;
+
+	psys_pkg_assert_valid(frozen);
+	return frozen;
 }
 
 /*** Retrieving the package data directory ************************************/
@@ -354,6 +696,14 @@ const char *psys_pkg_version(psys_pkg_t pkg)
 	return pkg->version;
 }
 
+const unsigned char *psys_pkg_verkey(psys_pkg_t pkg, size_t *len)
+{
+	assert(pkg != NULL);
+	assert(len != NULL);
+	*len = pkg->verkey_len;
+	return pkg->verkey;
+}
+
 const char *psys_pkg_lsbversion(psys_pkg_t pkg)
 {
 	assert(pkg != NULL);
@@ -371,13 +721,13 @@ const char *psys_pkg_arch(psys_pkg_t pkg)
 psys_tlist_t psys_pkg_summary(psys_pkg_t pkg)
 {
 	assert(pkg != NULL);
-	return pkg->summary;
+	return pkg->summary.list;
 }
 
 psys_tlist_t psys_pkg_description(psys_pkg_t pkg)
 {
 	assert(pkg != NULL);
-	return pkg->description;
+	return pkg->description.list;
 }
 
 /*** Adding optional package metadata ****************************************/
@@ -385,33 +735,46 @@ psys_tlist_t psys_pkg_description(psys_pkg_t pkg)
 int psys_pkg_add_summary(psys_pkg_t pkg, const char *locale,
 			 const char *summary)
 {
-	psys_tlist_t newlist;
-
 	assert(pkg != NULL);
+	assert(!pkg->refs && "Package is frozen");
 	assert(locale != NULL);
 	assert(summary != NULL);
 
-	newlist = tlist_add(pkg->summary, locale, summary);
-	if (!newlist)
-		return -1;
-	pkg->summary = newlist;
-	return 0;
+	return tlist_add(&pkg->arena, &pkg->summary, locale, summary);
+}
+
+int psys_pkg_add_summaries(psys_pkg_t pkg, const char * const *locales,
+			   const char * const *summaries, size_t count)
+{
+	assert(pkg != NULL);
+	assert(!pkg->refs && "Package is frozen");
+	assert(count == 0 || (locales != NULL && summaries != NULL));
+
+	return tlist_add_many(&pkg->arena, &pkg->summary, locales, summaries,
+			      count);
 }
 
 int psys_pkg_add_description(psys_pkg_t pkg, const char *locale,
 			     const char *description)
 {
-	psys_tlist_t newlist;
-
 	assert(pkg != NULL);
+	assert(!pkg->refs && "Package is frozen");
 	assert(locale != NULL);
 	assert(description != NULL);
 
-	newlist = tlist_add(pkg->description, locale, description);
-	if (!newlist)
-		return -1;
-	pkg->description = newlist;
-	return 0;
+	return tlist_add(&pkg->arena, &pkg->description, locale,
+			 description);
+}
+
+int psys_pkg_add_descriptions(psys_pkg_t pkg, const char * const *locales,
+			      const char * const *descriptions, size_t count)
+{
+	assert(pkg != NULL);
+	assert(!pkg->refs && "Package is frozen");
+	assert(count == 0 || (locales != NULL && descriptions != NULL));
+
+	return tlist_add_many(&pkg->arena, &pkg->description, locales,
+			      descriptions, count);
 }
 
 /*** Retrieving and adding package extra files ********************************/
@@ -427,36 +790,333 @@ int psys_pkg_add_extra(psys_pkg_t pkg, const char *path)
 	psys_plist_t newlist;
 
 	assert(pkg != NULL);
+	assert(!pkg->refs && "Package is frozen");
 	assert(path != NULL);
 
-	newlist = plist_add(pkg->extras, path);
+	newlist = plist_add(&pkg->arena, pkg->extras, path);
 	if (!newlist)
 		return -1;
 	pkg->extras = newlist;
 	return 0;
 }
 
+/*** Normalizing paths *******************************************************/
+
+int psys_path_normalize(char *path, size_t *len)
+{
+	const char *c, *end;
+	size_t out, n;
+
+	assert(path != NULL);
+
+	if (path[0] != '/')
+		return -1;
+
+	/*
+	 * Each component is moved forward to the end of the normalized
+	 * path so far, which never gets ahead of the part of the path
+	 * that has already been scanned
+	 */
+	out = 0;
+	for (c = path; *c; c = end) {
+		while (*c == '/')
+			c++;
+		end = strchr(c, '/');
+		if (!end)
+			end = c + strlen(c);
+		n = end - c;
+
+		if (!n || (n == 1 && c[0] == '.'))
+			continue;
+
+		if (n == 2 && c[0] == '.' && c[1] == '.') {
+			/* Drop the last component; "/.." is "/" */
+			while (out > 0 && path[--out] != '/')
+				;
+			continue;
+		}
+
+		path[out++] = '/';
+		memmove(path + out, c, n);
+		out += n;
+	}
+
+	if (!out)
+		path[out++] = '/';
+	path[out] = '\0';
+
+	if (len)
+		*len = out;
+	return 0;
+}
+
+/*** Sorting versions *********************************************************/
+
+struct verkey_item {
+	const unsigned char *key;
+	size_t len;
+	const char *version;
+};
+
+/* Buckets of fewer items are sorted by insertion instead of by radix */
+#define VERKEY_INSERTION_MAX 32
+
+/*
+ * Encodes the keys of all passed versions into a single newly allocated
+ * buffer, which is returned. Returns NULL on error.
+ */
+static unsigned char *verkey_encode_all(const char * const *versions,
+					size_t count,
+					struct verkey_item *items,
+					psys_err_t *err)
+{
+	unsigned char *keys, *pos;
+	size_t i, size;
+
+	size = 0;
+	for (i = 0; i < count; i++)
+		size += PSYS_VERKEY_MAX(strlen(versions[i]));
+
+	keys = psys_malloc(size ? size : 1);
+	if (!keys) {
+		psys_err_set_nomem(err);
+		return NULL;
+	}
+
+	pos = keys;
+	for (i = 0; i < count; i++) {
+		items[i].key = pos;
+		items[i].len = psys_verkey_encode(versions[i], pos, size);
+		items[i].version = versions[i];
+		if (!items[i].len) {
+			psys_err_set(err, PSYS_EVER, "Invalid version: %s",
+				     versions[i]);
+			psys_free(keys);
+			return NULL;
+		}
+		pos += items[i].len;
+		size -= items[i].len;
+	}
+
+	return keys;
+}
+
+/*
+ * Returns the bucket of an item when sorting by the key byte at depth.
+ * Keys which end before depth go first; since they are equal up to
+ * their end, they are also equal to each other.
+ */
+static inline size_t verkey_bucket(const struct verkey_item *item,
+				   size_t depth)
+{
+	return (depth < item->len) ? (size_t) item->key[depth] + 1 : 0;
+}
+
+static void verkey_insertion_sort(struct verkey_item *items, size_t count,
+				  size_t depth)
+{
+	size_t i, j;
+
+	/* The first depth bytes of all keys are known to be equal */
+	for (i = 1; i < count; i++) {
+		struct verkey_item item = items[i];
+
+		for (j = i; j > 0; j--) {
+			if (psys_verkey_cmp(items[j - 1].key + depth,
+					    items[j - 1].len - depth,
+					    item.key + depth,
+					    item.len - depth) <= 0)
+				break;
+			items[j] = items[j - 1];
+		}
+		items[j] = item;
+	}
+}
+
+static void verkey_radix_sort(struct verkey_item *items,
+			      struct verkey_item *tmp, size_t count,
+			      size_t depth)
+{
+	size_t sizes[257], starts[257];
+	size_t i, b;
+
+	/*
+	 * This is a most-significant-digit radix sort over the key bytes.
+	 * It is stable, so equal versions keep their relative order.
+	 */
+	for (;;) {
+		if (count <= VERKEY_INSERTION_MAX) {
+			verkey_insertion_sort(items, count, depth);
+			return;
+		}
+
+		memset(sizes, 0, sizeof(sizes));
+		for (i = 0; i < count; i++)
+			sizes[verkey_bucket(&items[i], depth)]++;
+
+		/* Skip bytes which are the same in all keys */
+		b = verkey_bucket(&items[0], depth);
+		if (sizes[b] != count)
+			break;
+		else if (b == 0)
+			return;
+		depth++;
+	}
+
+	starts[0] = 0;
+	for (b = 1; b < 257; b++)
+		starts[b] = starts[b - 1] + sizes[b - 1];
+
+	for (i = 0; i < count; i++)
+		tmp[starts[verkey_bucket(&items[i], depth)]++] = items[i];
+	memcpy(items, tmp, count * sizeof(*items));
+
+	for (b = 1, i = sizes[0]; b < 257; i += sizes[b], b++) {
+		if (sizes[b] > 1)
+			verkey_radix_sort(items + i, tmp, sizes[b],
+					  depth + 1);
+	}
+}
+
+int psys_version_sort(const char **versions, size_t count, psys_err_t *err)
+{
+	struct verkey_item *items;
+	unsigned char *keys;
+	size_t i;
+
+	assert(versions != NULL || count == 0);
+
+	if (!count)
+		return 0;
+
+	/* The second half is scratch space for the radix sort */
+	items = psys_malloc(2 * count * sizeof(*items));
+	if (!items) {
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	keys = verkey_encode_all(versions, count, items, err);
+	if (!keys) {
+		psys_free(items);
+		return -1;
+	}
+
+	verkey_radix_sort(items, items + count, count, 0);
+	for (i = 0; i < count; i++)
+		versions[i] = items[i].version;
+
+	psys_free(keys);
+	psys_free(items);
+	return 0;
+}
+
+int psys_version_max(const char * const *versions, size_t count,
+		     size_t *index, psys_err_t *err)
+{
+	unsigned char *max, *cur, *tmp;
+	size_t max_len, cur_len, size;
+	size_t i, len;
+	int ret;
+
+	assert(versions != NULL);
+	assert(count > 0);
+	assert(index != NULL);
+
+	/*
+	 * The key of the newest version found so far is kept in max, and
+	 * each other version is encoded into cur. Both buffers grow as
+	 * needed.
+	 */
+	ret = -1;
+	size = 0;
+	max = cur = NULL;
+	max_len = 0;
+
+	for (i = 0; i < count; i++) {
+		len = PSYS_VERKEY_MAX(strlen(versions[i]));
+		if (len > size) {
+			tmp = psys_realloc(cur, len);
+			if (!tmp)
+				goto nomem;
+			cur = tmp;
+			tmp = psys_realloc(max, len);
+			if (!tmp)
+				goto nomem;
+			max = tmp;
+			size = len;
+		}
+
+		cur_len = psys_verkey_encode(versions[i], cur, size);
+		if (!cur_len) {
+			psys_err_set(err, PSYS_EVER, "Invalid version: %s",
+				     versions[i]);
+			goto out;
+		}
+
+		if (!i || psys_verkey_cmp(cur, cur_len, max, max_len) > 0) {
+			tmp = max;
+			max = cur;
+			cur = tmp;
+			max_len = cur_len;
+			*index = i;
+		}
+	}
+
+	ret = 0;
+	goto out;
+nomem:
+	psys_err_set_nomem(err);
+out:
+	psys_free(max);
+	psys_free(cur);
+	return ret;
+}
+
+/*** Loading the backend ******************************************************/
+
+static void *impl_open(void)
+{
+	struct psys_phase phase;
+	void *impl;
+
+	psys_phase_begin(&phase, PSYS_PHASE_DISPATCH);
+	impl = dlopen(IMPL_LIB, IMPL_FLAGS);
+	psys_phase_end(&phase);
+	return impl;
+}
+
 /*** Adding packages to the system package database ***************************/
 
 static int announce_or_register(const char *sym, psys_pkg_t pkg,
 				psys_err_t *err)
 {
+	struct psys_span span;
 	void *impl;
 	int (*fn)(psys_pkg_t, psys_err_t *);
+	int ret;
+
+	/* Trace spans and probes are named after the frontend function */
+	psys_span_begin(&span, sym + 1);
+	PSYS_PROBE3(api__entry, span.name, psys_pkg_vendor(pkg),
+		    psys_pkg_name(pkg));
 
-	impl = dlopen(IMPL_LIB, RTLD_LAZY | RTLD_GLOBAL);
+	impl = impl_open();
 	if (impl) {
 		fn = (int (*)(psys_pkg_t, psys_err_t *)) dlsym(impl, sym);
 		if (fn) {
-			int ret;
 			ret = (*fn)(pkg, err);
 			dlclose(impl);
-			return ret;
+			goto out;
 		}
 	}
 
 	psys_err_set_notimpl(err);
-	return -1;
+	ret = -1;
+out:
+	PSYS_PROBE2(api__return, span.name, ret);
+	psys_span_end(&span);
+	return ret;
 }
 
 int psys_announce(psys_pkg_t pkg, psys_err_t *err)
@@ -486,26 +1146,34 @@ int psys_register_update(psys_pkg_t pkg, psys_err_t *err)
 static int unannounce_or_unregister(const char *sym, const char *vendor,
 				    const char *name, psys_err_t *err)
 {
+	struct psys_span span;
 	void *impl;
 	int (*fn)(const char *, const char *, psys_err_t *);
+	int ret;
 
-	impl = dlopen(IMPL_LIB, RTLD_LAZY | RTLD_GLOBAL);
+	psys_span_begin(&span, sym + 1);
+	PSYS_PROBE3(api__entry, span.name, vendor, name);
+
+	impl = impl_open();
 	if (impl) {
 		fn = (int (*)(const char *, const char *, psys_err_t *))
 				dlsym(impl, sym);
 
 		if (fn) {
-			int ret;
 			ret = (*fn)(vendor, name, err);
 			dlclose(impl);
-			return ret;
+			goto out;
 		}
 
 		dlclose(impl);
 	}
 
 	psys_err_set_notimpl(err);
-	return -1;
+	ret = -1;
+out:
+	PSYS_PROBE2(api__return, span.name, ret);
+	psys_span_end(&span);
+	return ret;
 }
 
 int psys_unannounce(const char *vendor, const char *name, psys_err_t *err)
@@ -517,3 +1185,284 @@ int psys_unregister(const char *vendor, const char *name, psys_err_t *err)
 {
 	return unannounce_or_unregister("_psys_unregister", vendor, name, err);
 }
+
+int psys_unregister_many(const char * const *vendors,
+			 const char * const *names, size_t count,
+			 psys_err_t *err)
+{
+	struct psys_span span;
+	void *impl;
+	int (*many_fn)(const char * const *, const char * const *, size_t,
+		       psys_err_t *);
+	int (*fn)(const char *, const char *, psys_err_t *);
+	size_t i;
+	int ret;
+
+	assert(count == 0 || vendors != NULL);
+	assert(count == 0 || names != NULL);
+	for (i = 0; i < count; i++) {
+		assert(vendors[i] != NULL);
+		assert(names[i] != NULL);
+	}
+
+	psys_span_begin(&span, "psys_unregister_many");
+	PSYS_PROBE3(api__entry, span.name, NULL, NULL);
+
+	impl = impl_open();
+	if (impl) {
+		many_fn = (int (*)(const char * const *, const char * const *,
+				   size_t, psys_err_t *))
+				dlsym(impl, "_psys_unregister_many");
+		if (many_fn) {
+			ret = (*many_fn)(vendors, names, count, err);
+			dlclose(impl);
+			goto out;
+		}
+
+		/* Backends without bulk support get one call per package */
+		fn = (int (*)(const char *, const char *, psys_err_t *))
+				dlsym(impl, "_psys_unregister");
+		if (fn) {
+			ret = 0;
+			for (i = 0; i < count && !ret; i++)
+				ret = (*fn)(vendors[i], names[i], err);
+			dlclose(impl);
+			goto out;
+		}
+
+		dlclose(impl);
+	}
+
+	psys_err_set_notimpl(err);
+	ret = -1;
+out:
+	PSYS_PROBE2(api__return, span.name, ret);
+	psys_span_end(&span);
+	return ret;
+}
+
+/*** Querying installed packages *********************************************/
+
+int psys_query(const char *vendor, const char *name, char **version,
+	       psys_err_t *err)
+{
+	struct psys_span span;
+	void *impl;
+	int (*fn)(const char *, const char *, char **, psys_err_t *);
+	int ret;
+
+	assert(vendor != NULL);
+	assert(name != NULL);
+	assert(version != NULL);
+
+	psys_span_begin(&span, "psys_query");
+	PSYS_PROBE3(api__entry, span.name, vendor, name);
+
+	impl = impl_open();
+	if (impl) {
+		fn = (int (*)(const char *, const char *, char **,
+			      psys_err_t *))
+				dlsym(impl, "_psys_query");
+
+		if (fn) {
+			ret = (*fn)(vendor, name, version, err);
+			dlclose(impl);
+			goto out;
+		}
+
+		dlclose(impl);
+	}
+
+	psys_err_set_notimpl(err);
+	ret = -1;
+out:
+	PSYS_PROBE2(api__return, span.name, ret);
+	psys_span_end(&span);
+	return ret;
+}
+
+/*** Looking up file owners **************************************************/
+
+int psys_owner_of(const char *path, char **vendor, char **name,
+		  psys_err_t *err)
+{
+	struct psys_span span;
+	void *impl;
+	int (*fn)(const char *, char **, char **, psys_err_t *);
+	int ret;
+
+	assert(path != NULL);
+	assert(vendor != NULL);
+	assert(name != NULL);
+
+	psys_span_begin(&span, "psys_owner_of");
+	PSYS_PROBE3(api__entry, span.name, path, NULL);
+
+	impl = impl_open();
+	if (impl) {
+		fn = (int (*)(const char *, char **, char **, psys_err_t *))
+				dlsym(impl, "_psys_owner_of");
+
+		if (fn) {
+			ret = (*fn)(path, vendor, name, err);
+			dlclose(impl);
+			goto out;
+		}
+
+		dlclose(impl);
+	}
+
+	psys_err_set_notimpl(err);
+	ret = -1;
+out:
+	PSYS_PROBE2(api__return, span.name, ret);
+	psys_span_end(&span);
+	return ret;
+}
+
+/*** Listing installed packages **********************************************/
+
+psys_pkg_iter_t psys_list_packages(psys_err_t *err)
+{
+	struct psys_span span;
+	psys_pkg_iter_t iter;
+	void *(*open_fn)(psys_err_t *);
+
+	iter = psys_calloc(1, sizeof(*iter));
+	if (!iter) {
+		psys_err_set_nomem(err);
+		return NULL;
+	}
+
+	/*
+	 * Unlike the other entry points, the backend library must stay
+	 * loaded until the iterator is freed
+	 */
+	iter->impl = impl_open();
+	if (!iter->impl)
+		goto notimpl;
+
+	open_fn = (void *(*)(psys_err_t *)) dlsym(iter->impl,
+						  "_psys_list_open");
+	iter->next = (int (*)(void *, const char **, const char **,
+			      const char **, const char **, psys_err_t *))
+			dlsym(iter->impl, "_psys_list_next");
+	iter->close = (void (*)(void *)) dlsym(iter->impl,
+					       "_psys_list_close");
+	if (!open_fn || !iter->next || !iter->close)
+		goto notimpl;
+
+	psys_span_begin(&span, "psys_list_packages");
+	PSYS_PROBE3(api__entry, span.name, NULL, NULL);
+	iter->list = (*open_fn)(err);
+	PSYS_PROBE2(api__return, span.name, iter->list ? 0 : -1);
+	psys_span_end(&span);
+	if (!iter->list) {
+		dlclose(iter->impl);
+		psys_free(iter);
+		return NULL;
+	}
+
+	return iter;
+notimpl:
+	if (iter->impl)
+		dlclose(iter->impl);
+	psys_free(iter);
+	psys_err_set_notimpl(err);
+	return NULL;
+}
+
+int psys_pkg_iter_next(psys_pkg_iter_t iter, psys_err_t *err)
+{
+	int ret;
+
+	assert(iter != NULL);
+
+	ret = (*iter->next)(iter->list, &iter->vendor, &iter->name,
+			    &iter->version, &iter->arch, err);
+	if (ret <= 0) {
+		iter->vendor = NULL;
+		iter->name = NULL;
+		iter->version = NULL;
+		iter->arch = NULL;
+	}
+	return ret;
+}
+
+const char *psys_pkg_iter_vendor(psys_pkg_iter_t iter)
+{
+	assert(iter != NULL);
+	assert(iter->vendor != NULL);
+	return iter->vendor;
+}
+
+const char *psys_pkg_iter_name(psys_pkg_iter_t iter)
+{
+	assert(iter != NULL);
+	assert(iter->name != NULL);
+	return iter->name;
+}
+
+const char *psys_pkg_iter_version(psys_pkg_iter_t iter)
+{
+	assert(iter != NULL);
+	assert(iter->version != NULL);
+	return iter->version;
+}
+
+const char *psys_pkg_iter_arch(psys_pkg_iter_t iter)
+{
+	assert(iter != NULL);
+	assert(iter->arch != NULL);
+	return iter->arch;
+}
+
+void psys_pkg_iter_free(psys_pkg_iter_t iter)
+{
+	if (iter) {
+		(*iter->close)(iter->list);
+		dlclose(iter->impl);
+		psys_free(iter);
+	}
+}
+
+/*** Verifying installed packages *********************************************/
+
+int psys_verify(const char *vendor, const char *name, int mode,
+		psys_verify_fn fn, void *data, psys_err_t *err)
+{
+	struct psys_span span;
+	void *impl;
+	int (*impl_fn)(const char *, const char *, int, psys_verify_fn,
+		       void *, psys_err_t *);
+	int ret;
+
+	assert(vendor != NULL);
+	assert(name != NULL);
+	assert(mode == PSYS_VERIFY_STAT || mode == PSYS_VERIFY_CONTENT);
+
+	psys_span_begin(&span, "psys_verify");
+	PSYS_PROBE3(api__entry, span.name, vendor, name);
+
+	impl = impl_open();
+	if (impl) {
+		impl_fn = (int (*)(const char *, const char *, int,
+				   psys_verify_fn, void *, psys_err_t *))
+				dlsym(impl, "_psys_verify");
+
+		if (impl_fn) {
+			ret = (*impl_fn)(vendor, name, mode, fn, data, err);
+			dlclose(impl);
+			goto out;
+		}
+
+		dlclose(impl);
+	}
+
+	psys_err_set_notimpl(err);
+	ret = -1;
+out:
+	PSYS_PROBE2(api__return, span.name, ret);
+	psys_span_end(&span);
+	return ret;
+}
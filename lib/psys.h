@@ -26,6 +26,9 @@
 #ifndef _PSYS_H
 #define _PSYS_H
 
+#include <stddef.h>
+#include <time.h>
+
 /* Error codes */
 enum {
 	PSYS_EACCESS,
@@ -37,7 +40,9 @@ enum {
 	PSYS_ENOMEM,
 	PSYS_ENOENT,
 	PSYS_ENOTIMPL,
-	PSYS_EVER
+	PSYS_EVER,
+	PSYS_ETIMEOUT,
+	PSYS_EINVAL
 };
 
 /* Package object type */
@@ -52,11 +57,93 @@ typedef struct _psys_tlist *psys_tlist_t;
 /* Path list type */
 typedef struct _psys_plist *psys_plist_t;
 
+/* Package iterator type */
+typedef struct _psys_pkg_iter *psys_pkg_iter_t;
+
+/* Statistics object type */
+typedef struct _psys_stats *psys_stats_t;
+
+/* Allocator function types */
+typedef void *(*psys_malloc_fn)(size_t size, void *ctx);
+typedef void *(*psys_realloc_fn)(void *ptr, size_t size, void *ctx);
+typedef void (*psys_free_fn)(void *ptr, void *ctx);
+
+/* Package verification callback type */
+typedef int (*psys_verify_fn)(const char *path, int problems, void *data);
+
+/* Error object allocation modes */
+enum {
+	PSYS_ERR_HEAP,
+	PSYS_ERR_THREAD
+};
+
+/* Package file hashing modes */
+enum {
+	PSYS_HASH_DEFAULT,
+	PSYS_HASH_NOCACHE,
+	PSYS_HASH_DIRECT
+};
+
+/* Package file hashing orders */
+enum {
+	PSYS_HASH_ORDER_LIST,
+	PSYS_HASH_ORDER_PHYSICAL
+};
+
+/* Package verification modes */
+enum {
+	PSYS_VERIFY_STAT,
+	PSYS_VERIFY_CONTENT
+};
+
+/* Problems found by package verification (may be combined) */
+enum {
+	PSYS_VERIFY_MISSING = 1,
+	PSYS_VERIFY_MODIFIED = 2,
+	PSYS_VERIFY_MODE = 4
+};
+
+/* Phases of package database operations measured by statistics objects */
+enum {
+	PSYS_PHASE_DISPATCH,
+	PSYS_PHASE_PROBE,
+	PSYS_PHASE_DB_OPEN,
+	PSYS_PHASE_WALK,
+	PSYS_PHASE_HASH,
+	PSYS_PHASE_INFO_WRITE,
+	PSYS_PHASE_HEADER,
+	PSYS_PHASE_DB_COMMIT
+};
+
+/* Counters kept by statistics objects */
+enum {
+	PSYS_STAT_FILES,
+	PSYS_STAT_BYTES_HASHED,
+	PSYS_STAT_SYSCALLS,
+	PSYS_STAT_ALLOCS,
+	PSYS_STAT_LOCK_WAIT_NS
+};
+
+/* I/O scheduling classes (see ioprio_set(2)) */
+enum {
+	PSYS_IOPRIO_NONE,
+	PSYS_IOPRIO_RT,
+	PSYS_IOPRIO_BE,
+	PSYS_IOPRIO_IDLE
+};
+
+
+/* Replacing the memory allocator */
+extern void psys_set_allocator(psys_malloc_fn malloc_fn,
+			       psys_realloc_fn realloc_fn,
+			       psys_free_fn free_fn, void *ctx);
 
 /* Handling errors */
 extern int psys_err_code(psys_err_t err);
 extern const char *psys_err_msg(psys_err_t err);
 extern void psys_err_free(psys_err_t err);
+extern int psys_err_mode(void);
+extern void psys_set_err_mode(int mode);
 
 /* Traversing translation lists */
 extern const char *psys_tlist_locale(psys_tlist_t elem);
@@ -72,6 +159,12 @@ extern psys_pkg_t psys_pkg_new(const char *vendor, const char *name,
 			       const char *version, const char *lsbversion,
 			       const char *arch);
 extern void psys_pkg_free(psys_pkg_t pkg);
+extern psys_pkg_t psys_pkg_freeze(psys_pkg_t pkg);
+
+/* Validating package metadata */
+extern int psys_pkg_validate(const char *vendor, const char *name,
+			     const char *version, const char *lsbversion,
+			     const char *arch, psys_err_t *err);
 
 /* Retrieving the package data directory */
 extern const char *psys_pkg_dir(psys_pkg_t pkg);
@@ -92,11 +185,26 @@ extern int psys_pkg_add_summary(psys_pkg_t pkg, const char *locale,
 				const char *summary);
 extern int psys_pkg_add_description(psys_pkg_t pkg, const char *locale,
 				    const char *value);
+extern int psys_pkg_add_summaries(psys_pkg_t pkg, const char * const *locales,
+				  const char * const *summaries, size_t count);
+extern int psys_pkg_add_descriptions(psys_pkg_t pkg,
+				     const char * const *locales,
+				     const char * const *descriptions,
+				     size_t count);
 
 /* Retrieving and adding package extra files */
 extern psys_plist_t psys_pkg_extras(psys_pkg_t pkg);
 extern int psys_pkg_add_extra(psys_pkg_t pkg, const char *path);
 
+/* Normalizing paths */
+extern int psys_path_normalize(char *path, size_t *len);
+
+/* Sorting versions */
+extern int psys_version_sort(const char **versions, size_t count,
+			     psys_err_t *err);
+extern int psys_version_max(const char * const *versions, size_t count,
+			    size_t *index, psys_err_t *err);
+
 /* Adding packages to the system package database */
 extern int psys_announce(psys_pkg_t pkg, psys_err_t *err);
 extern int psys_register(psys_pkg_t pkg, psys_err_t *err);
@@ -110,5 +218,55 @@ extern int psys_unannounce(const char *vendor, const char *name,
 			   psys_err_t *err);
 extern int psys_unregister(const char *vendor, const char *name,
 			   psys_err_t *err);
+extern int psys_unregister_many(const char * const *vendors,
+				const char * const *names, size_t count,
+				psys_err_t *err);
+
+/* Querying installed packages */
+extern int psys_query(const char *vendor, const char *name, char **version,
+		      psys_err_t *err);
+
+/* Looking up file owners */
+extern int psys_owner_of(const char *path, char **vendor, char **name,
+			 psys_err_t *err);
+
+/* Listing installed packages */
+extern psys_pkg_iter_t psys_list_packages(psys_err_t *err);
+extern int psys_pkg_iter_next(psys_pkg_iter_t iter, psys_err_t *err);
+extern const char *psys_pkg_iter_vendor(psys_pkg_iter_t iter);
+extern const char *psys_pkg_iter_name(psys_pkg_iter_t iter);
+extern const char *psys_pkg_iter_version(psys_pkg_iter_t iter);
+extern const char *psys_pkg_iter_arch(psys_pkg_iter_t iter);
+extern void psys_pkg_iter_free(psys_pkg_iter_t iter);
+
+/* Verifying installed packages */
+extern int psys_verify(const char *vendor, const char *name, int mode,
+		       psys_verify_fn fn, void *data, psys_err_t *err);
+
+/* Controlling package file hashing */
+extern int psys_hash_mode(void);
+extern void psys_set_hash_mode(int mode);
+extern int psys_hash_order(void);
+extern void psys_set_hash_order(int order);
+extern unsigned long long psys_hash_bytes_read(void);
+extern unsigned long long psys_hash_pages_dropped(void);
+
+/* Limiting resource usage of package file traversal and hashing */
+extern void psys_set_read_rate(unsigned long long bytes_per_sec);
+extern void psys_set_hash_threads(int nthreads);
+extern void psys_set_io_priority(int ioclass, int level);
+extern void psys_set_nice(int niceness);
+extern void psys_set_deadline(time_t deadline);
+
+/* Collecting statistics */
+extern psys_stats_t psys_stats_new(void);
+extern void psys_stats_free(psys_stats_t stats);
+extern void psys_stats_reset(psys_stats_t stats);
+extern psys_stats_t psys_stats_attach(psys_stats_t stats);
+extern unsigned long long psys_stats_calls(psys_stats_t stats, int phase);
+extern unsigned long long psys_stats_wall_ns(psys_stats_t stats, int phase);
+extern unsigned long long psys_stats_cpu_ns(psys_stats_t stats, int phase);
+extern unsigned long long psys_stats_counter(psys_stats_t stats, int counter);
+extern char *psys_stats_json(psys_stats_t stats);
 
 #endif /* _PSYS_H */
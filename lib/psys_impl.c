@@ -22,35 +22,65 @@
 /* Needed for asprintf() */
 #define _GNU_SOURCE
 
-/* Needed for nftw() */
-#define _XOPEN_SOURCE 500
-
 /* Always compile with assertions */
 #undef NDEBUG
 
+#include <config.h>
+
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
-#include <ftw.h>
+#include <fcntl.h>
+#include <fts.h>
 #include <limits.h>
 #include <locale.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
 
 #include "psys_impl.h"
+#include "psys_md5.h"
 #include "psys_private.h"
+#include "psys_probes.h"
+
+/* Character classes of package metadata (see psysmeta(7)) */
+#define CC_DIGIT	0x01
+#define CC_LOWER	0x02
+#define CC_DOT		0x04
+#define CC_HYPHEN	0x08
+
+#define CC_VENDOR	(CC_DIGIT | CC_LOWER | CC_DOT)
+#define CC_NAME		(CC_DIGIT | CC_LOWER | CC_HYPHEN)
+
+static const unsigned char char_class[256] = {
+	['-'] = CC_HYPHEN,
+	['.'] = CC_DOT,
+	['0' ... '9'] = CC_DIGIT,
+	['a' ... 'z'] = CC_LOWER
+};
 
-#define xisdigit(c) (c >= '0' && c <= '9')
-#define xislower(c) (c >= 'a' || c <= 'z')
+#define xisdigit(c) (char_class[(unsigned char) (c)] & CC_DIGIT)
+#define xislower(c) (char_class[(unsigned char) (c)] & CC_LOWER)
 
 struct _psys_flist {
 	struct _psys_flist *next;
 	char *path;
 	struct stat *stat;
+	char *md5;
 };
 
 /*
@@ -58,19 +88,481 @@ struct _psys_flist {
  * because, well, if we're out of memory we can't, like, allocate a new
  * error object on-the-fly, right?
  */
-static struct _psys_err _err_nomem = {PSYS_ENOMEM, NULL};
+static struct _psys_err _err_nomem = {PSYS_ENOMEM, NULL, 1};
+
+/*** Collecting statistics ****************************************************/
+
+#define NPHASES		(PSYS_PHASE_DB_COMMIT + 1)
+#define NCOUNTERS	(PSYS_STAT_LOCK_WAIT_NS + 1)
+
+/*
+ * All fields are updated atomically, as hash worker threads add to the
+ * statistics object of the thread that started them.
+ */
+struct _psys_stats {
+	unsigned long long calls[NPHASES];
+	unsigned long long wall_ns[NPHASES];
+	unsigned long long cpu_ns[NPHASES];
+	unsigned long long counters[NCOUNTERS];
+};
+
+/* Names of phases and counters in psys_stats_json() output */
+static const char * const phase_names[NPHASES] = {
+	"dispatch", "probe", "db_open", "walk", "hash", "info_write",
+	"header", "db_commit"
+};
+static const char * const counter_names[NCOUNTERS] = {
+	"files", "bytes_hashed", "syscalls", "allocs", "lock_wait_ns"
+};
+
+/* The statistics object attached to the calling thread */
+static __thread psys_stats_t _stats = NULL;
+
+psys_stats_t psys_stats_new(void)
+{
+	return psys_calloc(1, sizeof(struct _psys_stats));
+}
+
+void psys_stats_free(psys_stats_t stats)
+{
+	psys_free(stats);
+}
+
+void psys_stats_reset(psys_stats_t stats)
+{
+	assert(stats != NULL);
+	memset(stats, 0, sizeof(*stats));
+}
+
+psys_stats_t psys_stats_attach(psys_stats_t stats)
+{
+	psys_stats_t prev;
+
+	prev = _stats;
+	_stats = stats;
+	return prev;
+}
+
+unsigned long long psys_stats_calls(psys_stats_t stats, int phase)
+{
+	assert(stats != NULL);
+	assert(phase >= 0 && phase < NPHASES);
+	return __atomic_load_n(&stats->calls[phase], __ATOMIC_RELAXED);
+}
+
+unsigned long long psys_stats_wall_ns(psys_stats_t stats, int phase)
+{
+	assert(stats != NULL);
+	assert(phase >= 0 && phase < NPHASES);
+	return __atomic_load_n(&stats->wall_ns[phase], __ATOMIC_RELAXED);
+}
+
+unsigned long long psys_stats_cpu_ns(psys_stats_t stats, int phase)
+{
+	assert(stats != NULL);
+	assert(phase >= 0 && phase < NPHASES);
+	return __atomic_load_n(&stats->cpu_ns[phase], __ATOMIC_RELAXED);
+}
+
+unsigned long long psys_stats_counter(psys_stats_t stats, int counter)
+{
+	assert(stats != NULL);
+	assert(counter >= 0 && counter < NCOUNTERS);
+	return __atomic_load_n(&stats->counters[counter], __ATOMIC_RELAXED);
+}
+
+char *psys_stats_json(psys_stats_t stats)
+{
+	FILE *f;
+	char *json;
+	size_t size;
+	int i;
+
+	assert(stats != NULL);
+
+	f = open_memstream(&json, &size);
+	if (!f)
+		return NULL;
+
+	fputs("{\"phases\":{", f);
+	for (i = 0; i < NPHASES; i++) {
+		fprintf(f, "%s\"%s\":{\"calls\":%llu,\"wall_ns\":%llu,"
+			"\"cpu_ns\":%llu}", i ? "," : "", phase_names[i],
+			psys_stats_calls(stats, i),
+			psys_stats_wall_ns(stats, i),
+			psys_stats_cpu_ns(stats, i));
+	}
+	fputs("},\"counters\":{", f);
+	for (i = 0; i < NCOUNTERS; i++) {
+		fprintf(f, "%s\"%s\":%llu", i ? "," : "", counter_names[i],
+			psys_stats_counter(stats, i));
+	}
+	fputs("}}", f);
+
+	if (ferror(f)) {
+		fclose(f);
+		free(json);
+		return NULL;
+	}
+	if (fclose(f))
+		return NULL;
+	return json;
+}
+
+static unsigned long long timespec_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+void psys_phase_begin(struct psys_phase *p, int phase)
+{
+	assert(phase >= 0 && phase < NPHASES);
+
+	/*
+	 * Remember the statistics object, so that detaching it within
+	 * the phase does not lose the measurement
+	 */
+	p->stats = _stats;
+	p->phase = phase;
+	psys_span_begin(&p->span, phase_names[phase]);
+	PSYS_PROBE2(phase__begin, phase, phase_names[phase]);
+	if (p->stats) {
+		clock_gettime(CLOCK_MONOTONIC, &p->wall);
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &p->cpu);
+	}
+}
+
+void psys_phase_end(struct psys_phase *p)
+{
+	struct timespec wall, cpu;
+
+	PSYS_PROBE2(phase__end, p->phase, phase_names[p->phase]);
+	psys_span_end(&p->span);
+	if (!p->stats)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+
+	__atomic_fetch_add(&p->stats->calls[p->phase], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&p->stats->wall_ns[p->phase],
+			   timespec_ns(&wall) - timespec_ns(&p->wall),
+			   __ATOMIC_RELAXED);
+	__atomic_fetch_add(&p->stats->cpu_ns[p->phase],
+			   timespec_ns(&cpu) - timespec_ns(&p->cpu),
+			   __ATOMIC_RELAXED);
+}
+
+void psys_stats_add(int counter, unsigned long long n)
+{
+	assert(counter >= 0 && counter < NCOUNTERS);
+
+	if (_stats) {
+		__atomic_fetch_add(&_stats->counters[counter], n,
+				   __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Locks a mutex, counting the time spent waiting for it. The clock is
+ * only read if the mutex is contended.
+ */
+static void lock_mutex(pthread_mutex_t *mutex)
+{
+	struct timespec start, end;
+
+	if (pthread_mutex_trylock(mutex)) {
+		PSYS_PROBE1(lock__contended, mutex);
+		if (_stats) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			pthread_mutex_lock(mutex);
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			psys_stats_add(PSYS_STAT_LOCK_WAIT_NS,
+				       timespec_ns(&end) -
+				       timespec_ns(&start));
+		} else {
+			pthread_mutex_lock(mutex);
+		}
+	}
+	PSYS_PROBE1(lock__acquire, mutex);
+}
+
+static void unlock_mutex(pthread_mutex_t *mutex)
+{
+	pthread_mutex_unlock(mutex);
+	PSYS_PROBE1(lock__release, mutex);
+}
+
+/*** Tracing operations *******************************************************/
+
+/* Number of trace events per buffer chunk */
+#define TRACE_CHUNK_SIZE 1024
+
+struct trace_event {
+	const char *name;
+	unsigned long long start;
+	unsigned long long dur;
+};
+
+struct trace_chunk {
+	struct trace_chunk *next;
+	struct trace_event events[TRACE_CHUNK_SIZE];
+};
+
+/*
+ * Each thread records its events into its own buffer, so that recording
+ * needs no locks. Events are only ever appended, and the number of events
+ * is published after each event is complete, so the buffers can be read
+ * at exit even if a thread is still running.
+ */
+struct trace_buf {
+	struct trace_buf *next;
+	long tid;
+	struct trace_chunk *first;
+	struct trace_chunk *last;
+	size_t count;
+};
+
+static pthread_once_t _trace_once = PTHREAD_ONCE_INIT;
+static const char *_trace_path = NULL;
+static struct trace_buf *_trace_bufs = NULL;
+static __thread struct trace_buf *_trace_buf = NULL;
+
+static unsigned long long trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_ns(&ts);
+}
+
+static void trace_write(void)
+{
+	struct trace_buf *b;
+	struct trace_chunk *c;
+	struct trace_event *e;
+	FILE *f;
+	size_t i, count;
+	int first;
+	long pid;
+
+	f = fopen(_trace_path, "w");
+	if (!f)
+		return;
+
+	pid = getpid();
+	first = 1;
+	fputs("{\"traceEvents\":[", f);
+
+	b = __atomic_load_n(&_trace_bufs, __ATOMIC_ACQUIRE);
+	for (; b; b = b->next) {
+		count = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+		for (i = 0, c = b->first; i < count; i++) {
+			if (i && !(i % TRACE_CHUNK_SIZE))
+				c = c->next;
+			e = &c->events[i % TRACE_CHUNK_SIZE];
+
+			fprintf(f, "%s\n{\"name\":\"%s\",\"cat\":\"psys\","
+				"\"ph\":\"X\",\"ts\":%llu.%03llu,"
+				"\"dur\":%llu.%03llu,\"pid\":%ld,\"tid\":%ld}",
+				first ? "" : ",", e->name,
+				e->start / 1000, e->start % 1000,
+				e->dur / 1000, e->dur % 1000, pid, b->tid);
+			first = 0;
+		}
+	}
+
+	fputs("\n]}\n", f);
+	fclose(f);
+}
+
+static void trace_init(void)
+{
+	const char *path;
+
+	path = getenv("PSYS_TRACE");
+	if (path && *path) {
+		_trace_path = path;
+		atexit(trace_write);
+	}
+}
+
+/*
+ * The trace buffers are allocated with malloc() rather than psys_malloc(),
+ * as they are only read at exit, when the application's allocator might
+ * be gone already. They are never freed.
+ */
+static void trace_add(const char *name, unsigned long long start,
+		      unsigned long long dur)
+{
+	struct trace_buf *b;
+	struct trace_event *e;
+	size_t i;
+
+	b = _trace_buf;
+	if (!b) {
+		b = calloc(1, sizeof(*b));
+		if (!b)
+			return;
+		b->tid = syscall(SYS_gettid);
+
+		b->next = __atomic_load_n(&_trace_bufs, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&_trace_bufs, &b->next, b,
+						    0, __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+		_trace_buf = b;
+	}
+
+	i = b->count % TRACE_CHUNK_SIZE;
+	if (!i) {
+		struct trace_chunk *c;
+
+		c = malloc(sizeof(*c));
+		if (!c)
+			return;
+		c->next = NULL;
+
+		if (b->last)
+			b->last->next = c;
+		else
+			b->first = c;
+		b->last = c;
+	}
+
+	e = &b->last->events[i];
+	e->name = name;
+	e->start = start;
+	e->dur = dur;
+	__atomic_store_n(&b->count, b->count + 1, __ATOMIC_RELEASE);
+}
+
+void psys_span_begin(struct psys_span *s, const char *name)
+{
+	pthread_once(&_trace_once, trace_init);
+
+	s->name = name;
+	s->start = _trace_path ? trace_now() : 0;
+}
+
+void psys_span_end(struct psys_span *s)
+{
+	if (s->start)
+		trace_add(s->name, s->start, trace_now() - s->start);
+}
+
+/*** Allocating memory ********************************************************/
 
 /*
- * We need these global pointers to construct file lists in
- * psys_pkg_flist(), as this is the only way for that function to
- * share data with the traversal function passed to nftw() (which is used
- * to implement psys_pkg_flist()). If C just had support for closures...
- * oh well.
+ * The allocator set with psys_set_allocator(), or NULL functions for the
+ * C library allocator
  */
-static psys_pkg_t _pkg = NULL;
-static psys_err_t *_err;
-static psys_flist_t _flist = NULL;
-static psys_flist_t _flist_last = NULL;
+static psys_malloc_fn _malloc_fn = NULL;
+static psys_realloc_fn _realloc_fn = NULL;
+static psys_free_fn _free_fn = NULL;
+static void *_alloc_ctx = NULL;
+
+void psys_set_allocator(psys_malloc_fn malloc_fn, psys_realloc_fn realloc_fn,
+			psys_free_fn free_fn, void *ctx)
+{
+	assert((malloc_fn && realloc_fn && free_fn) ||
+	       (!malloc_fn && !realloc_fn && !free_fn));
+
+	_malloc_fn = malloc_fn;
+	_realloc_fn = realloc_fn;
+	_free_fn = free_fn;
+	_alloc_ctx = ctx;
+}
+
+void *psys_malloc(size_t size)
+{
+	psys_stats_add(PSYS_STAT_ALLOCS, 1);
+	if (_malloc_fn)
+		return (*_malloc_fn)(size ? size : 1, _alloc_ctx);
+	else
+		return malloc(size);
+}
+
+void *psys_calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if (size && nmemb > SIZE_MAX / size)
+		return NULL;
+
+	ptr = psys_malloc(nmemb * size);
+	if (ptr)
+		memset(ptr, 0, nmemb * size);
+	return ptr;
+}
+
+void *psys_realloc(void *ptr, size_t size)
+{
+	psys_stats_add(PSYS_STAT_ALLOCS, 1);
+	if (_realloc_fn)
+		return (*_realloc_fn)(ptr, size ? size : 1, _alloc_ctx);
+	else
+		return realloc(ptr, size);
+}
+
+void psys_free(void *ptr)
+{
+	if (!ptr)
+		return;
+	else if (_free_fn)
+		(*_free_fn)(ptr, _alloc_ctx);
+	else
+		free(ptr);
+}
+
+char *psys_strdup(const char *str)
+{
+	return psys_strndup(str, strlen(str));
+}
+
+char *psys_strndup(const char *str, size_t len)
+{
+	char *dup;
+
+	len = strnlen(str, len);
+	dup = psys_malloc(len + 1);
+	if (dup) {
+		memcpy(dup, str, len);
+		dup[len] = '\0';
+	}
+	return dup;
+}
+
+static int alloc_vasprintf(char **strp, const char *format, va_list vl)
+{
+	va_list vl2;
+	int len;
+
+	*strp = NULL;
+
+	va_copy(vl2, vl);
+	len = vsnprintf(NULL, 0, format, vl2);
+	va_end(vl2);
+	if (len < 0)
+		return -1;
+
+	*strp = psys_malloc(len + 1);
+	if (!*strp)
+		return -1;
+	vsnprintf(*strp, len + 1, format, vl);
+	return len;
+}
+
+int psys_asprintf(char **strp, const char *format, ...)
+{
+	va_list vl;
+	int ret;
+
+	va_start(vl, format);
+	ret = alloc_vasprintf(strp, format, vl);
+	va_end(vl);
+	return ret;
+}
 
 /*** Looking up the system's LSB distributor ID *******************************/
 
@@ -123,72 +615,98 @@ psys_pkg_t psys_pkg_copy(psys_pkg_t pkg)
 	return pkg2;
 }
 
-static void assert_vendor_valid(const char *vendor)
+/*
+ * The valid architectures, placed by arch_hash(). The hash function was
+ * chosen to map each of them to a different slot, so that a lookup needs
+ * at most one string comparison.
+ */
+#define ARCH_SLOTS 16
+
+static const char * const arch_table[ARCH_SLOTS] = {
+	[0] = "s390x",
+	[1] = "ia64",
+	[6] = "ppc",
+	[7] = "s390",
+	[9] = "ppc64",
+	[10] = "amd64",
+	[12] = "noarch",
+	[15] = "ia32"
+};
+
+static inline unsigned int arch_hash(const char *arch, size_t len)
 {
-	const char *c;
-	assert(vendor != NULL);
-	for (c = vendor; *c; c++)
-		assert(xislower(*c) || xisdigit(*c) || *c == '.');
+	return (len + (unsigned char) arch[0] +
+		(unsigned char) arch[len - 1]) % ARCH_SLOTS;
 }
 
-static void assert_name_valid(const char *name)
+static int chars_are_valid(const char *s, unsigned char allowed)
 {
-	const char *c;
-	assert(name != NULL);
-	for (c = name; *c; c++)
-		assert(xislower(*c) || xisdigit(*c) || *c == '-');
+	const unsigned char *c;
+
+	for (c = (const unsigned char *) s; *c; c++) {
+		if (!(char_class[*c] & allowed))
+			return 0;
+	}
+	return 1;
 }
 
 static int version_is_valid(const char *version)
 {
-	const char *v;
-	enum {DIGIT, LOWER, ANY} expected;
-
-	expected = DIGIT;
-	for (v = version; *v; v++) {
-		switch (expected) {
-		case DIGIT:
-			if (!xisdigit(*v))
-				return -1;
-			break;
-		case LOWER:
-			if (!xislower(*v))
-				return -1;
-			break;
-		case ANY:
-			if (*v == '.')
-				expected = DIGIT;
-			else if (xislower(*v))
-				expected = LOWER;
-		}
-	}
-	return 0;
+	return psys_verkey_encode(version, NULL, 0) != 0;
 }
 
-static void assert_version_valid(const char *version)
+static int lsbversion_is_valid(const char *lsbversion)
 {
-	assert(version != NULL);
-	assert(version_is_valid(version));
+	return xisdigit(lsbversion[0]) && lsbversion[1] == '.' &&
+	       xisdigit(lsbversion[2]) && lsbversion[3] == '\0';
 }
 
-static void assert_lsbversion_valid(const char *lsbversion)
+static int arch_is_valid(const char *arch)
 {
-	assert(lsbversion != NULL);
-	assert(xisdigit(lsbversion[0]) && lsbversion[1] == '.' &&
-	       xisdigit(lsbversion[2]) && lsbversion[3] == '\0');
+	const char *slot;
+	size_t len;
+
+	len = strlen(arch);
+	if (!len)
+		return 0;
+
+	slot = arch_table[arch_hash(arch, len)];
+	return slot && !strcmp(slot, arch);
 }
 
-static void assert_arch_valid(const char *arch)
+int psys_pkg_validate(const char *vendor, const char *name,
+		      const char *version, const char *lsbversion,
+		      const char *arch, psys_err_t *err)
 {
+	assert(vendor != NULL);
+	assert(name != NULL);
+	assert(version != NULL);
+	assert(lsbversion != NULL);
 	assert(arch != NULL);
-	assert(!strcmp(arch, "amd64") ||
-	       !strcmp(arch, "ia32") ||
-	       !strcmp(arch, "ia64") ||
-	       !strcmp(arch, "noarch") ||
-	       !strcmp(arch, "ppc") ||
-	       !strcmp(arch, "ppc64") ||
-	       !strcmp(arch, "s390") ||
-	       !strcmp(arch, "s390x"));
+
+	if (!chars_are_valid(vendor, CC_VENDOR)) {
+		psys_err_set(err, PSYS_EINVAL, "Invalid vendor: %s", vendor);
+		return -1;
+	}
+	if (!chars_are_valid(name, CC_NAME)) {
+		psys_err_set(err, PSYS_EINVAL, "Invalid name: %s", name);
+		return -1;
+	}
+	if (!version_is_valid(version)) {
+		psys_err_set(err, PSYS_EVER, "Invalid version: %s", version);
+		return -1;
+	}
+	if (!lsbversion_is_valid(lsbversion)) {
+		psys_err_set(err, PSYS_ELSBVER, "Invalid LSB version: %s",
+			     lsbversion);
+		return -1;
+	}
+	if (!arch_is_valid(arch)) {
+		psys_err_set(err, PSYS_EARCH, "Invalid architecture: %s",
+			     arch);
+		return -1;
+	}
+	return 0;
 }
 
 static void assert_tlist_valid(psys_tlist_t list)
@@ -211,17 +729,16 @@ static void assert_plist_valid(psys_plist_t list)
 		path = psys_plist_path(l);
 		assert(path != NULL);
 		assert(psys_path_is_canonical(path));
-		assert(path[strlen(path) - 1] != '/');
 	}
 }
 
 void psys_pkg_assert_valid(psys_pkg_t pkg)
 {
-	assert_vendor_valid(psys_pkg_vendor(pkg));
-	assert_name_valid(psys_pkg_name(pkg));
-	assert_version_valid(psys_pkg_version(pkg));
-	assert_lsbversion_valid(psys_pkg_lsbversion(pkg));
-	assert_arch_valid(psys_pkg_arch(pkg));
+	assert(chars_are_valid(psys_pkg_vendor(pkg), CC_VENDOR));
+	assert(chars_are_valid(psys_pkg_name(pkg), CC_NAME));
+	assert(version_is_valid(psys_pkg_version(pkg)));
+	assert(lsbversion_is_valid(psys_pkg_lsbversion(pkg)));
+	assert(arch_is_valid(psys_pkg_arch(pkg)));
 	assert_tlist_valid(psys_pkg_summary(pkg));
 	assert_tlist_valid(psys_pkg_description(pkg));
 	assert_plist_valid(psys_pkg_extras(pkg));
@@ -229,105 +746,145 @@ void psys_pkg_assert_valid(psys_pkg_t pkg)
 
 /*** Comparing package versions ***********************************************/
 
-static int psys_vercmp(const char *version1, const char *version2)
+/*
+ * Tags starting each segment of a version key. Their order makes a
+ * numeric segment newer than an alphabetic one, and any segment newer
+ * than the end of the version.
+ */
+#define VERKEY_END	0x01
+#define VERKEY_ALPHA	0x02
+#define VERKEY_NUM	0x03
+
+/* Digit counts of this value and above are followed by 4 more bytes */
+#define VERKEY_LONG	0xff
+
+/* Size of the on-stack buffer for encoding versions to compare */
+#define VERKEY_BUFSIZE	256
+
+static inline void verkey_put(unsigned char *key, size_t size, size_t *pos,
+			      unsigned char c)
 {
-	int v1_len, v2_len;
-	const char *v1s_start, *v2s_start;
-	const char *v1s_end, *v2s_end;
-	int v1s_isdigit, v2s_isdigit;
-	int diff;
+	if (*pos < size)
+		key[*pos] = c;
+	(*pos)++;
+}
+
+size_t psys_verkey_encode(const char *version, unsigned char *key,
+			  size_t size)
+{
+	const char *v, *digits;
+	size_t pos, ndigits;
 
 	/*
-	 * psys_vercmp() is implemented recursively. It always compares
-	 * one version segment at a time, calling itself to compare the
-	 * next segment if necessary. The initially passed versions are
-	 * assumed to be valid (this is asserted by psys_pkg_vercmp()).
-	 *
 	 * The version comparison algorithm is described in the psysmeta(7)
-	 * man page, which is also availabe online:
+	 * man page. We encode each segment such that comparing the keys
+	 * with memcmp() yields the same result:
+	 *
+	 * - A numeric segment is stored as its tag, the number of digits
+	 *   without leading zeros and the remaining digits. A number with
+	 *   more digits is always the higher one, and numbers of equal
+	 *   length compare like their digits.
 	 *
-	 * http://gitorious.org/libpsys/pages/Psysmeta
+	 * - The alphabetic segment is stored as its tag and its letters,
+	 *   terminated by a zero byte so that a shorter prefix sorts first.
+	 *
+	 * The version is validated along the way. Like snprintf(), this
+	 * writes at most size bytes and returns the length of the whole
+	 * key, or 0 if the version is invalid.
 	 */
-
-	v1_len = strlen(version1);
-	v2_len = strlen(version1);
-	if (!v1_len && !v2_len) {
-		if (v1_len)
-			return 1;
-		else if (v2_len)
-			return -1;
-		else
+	pos = 0;
+	v = version;
+	for (;;) {
+		if (!xisdigit(*v))
 			return 0;
-	}
+		while (*v == '0')
+			v++;
+		for (digits = v; xisdigit(*v); v++)
+			;
+
+		ndigits = v - digits;
+		verkey_put(key, size, &pos, VERKEY_NUM);
+		if (ndigits < VERKEY_LONG)
+			verkey_put(key, size, &pos, ndigits);
+		else {
+			verkey_put(key, size, &pos, VERKEY_LONG);
+			verkey_put(key, size, &pos, (ndigits >> 24) & 0xff);
+			verkey_put(key, size, &pos, (ndigits >> 16) & 0xff);
+			verkey_put(key, size, &pos, (ndigits >> 8) & 0xff);
+			verkey_put(key, size, &pos, ndigits & 0xff);
+		}
+		for (; digits < v; digits++)
+			verkey_put(key, size, &pos, *digits);
 
-	v1s_start = v1s_end = version1;
-	v2s_start = v2s_end =  version2;
+		if (*v != '.')
+			break;
+		v++;
+	}
 
-	v1s_isdigit = xisdigit(*v1s_start);
-	v2s_isdigit = xisdigit(*v2s_start);
+	if (*v) {
+		verkey_put(key, size, &pos, VERKEY_ALPHA);
+		for (; xislower(*v); v++)
+			verkey_put(key, size, &pos, *v);
+		if (*v)
+			return 0;
+		verkey_put(key, size, &pos, 0);
+	}
 
-	diff = 0;
+	verkey_put(key, size, &pos, VERKEY_END);
+	return pos;
+}
 
-	if (v1s_isdigit == v2s_isdigit) {
-		size_t v1s_len, v2s_len;
+int psys_verkey_cmp(const unsigned char *key1, size_t len1,
+		    const unsigned char *key2, size_t len2)
+{
+	int diff;
 
-		if (v1s_isdigit) {
-			while (*v1s_start == '0') {
-				v1s_start++;
-				v1s_end++;
-			}
-			while (*v2s_start == '0') {
-				v2s_start++;
-				v2s_end++;
-			}
+	diff = memcmp(key1, key2, (len1 < len2) ? len1 : len2);
+	if (!diff)
+		diff = (len1 > len2) - (len1 < len2);
+	return (diff > 0) - (diff < 0);
+}
 
-			while (xisdigit(*v1s_end))
-				v1s_end++;
-			while (xisdigit(*v2s_end))
-				v2s_end++;
-		} else {
-			/*
-			 * We don't need to check with xislower() because
-			 * the alphabetic segment is always the last.
-			 */
-			while (*v1s_end) {
-				assert(xislower(*v1s_end));
-				v1s_end++;
-			}
-			while (*v2s_end) {
-				assert(xislower(*v2s_end));
-				v2s_end++;
-			}
-		}
+/*
+ * Compares a version key to a version string, which is encoded on the
+ * stack unless it is unusually long. Returns -1, 0 or 1 like
+ * psys_verkey_cmp(), or -2 if the version string is invalid.
+ */
+static int verkey_cmp_version(const unsigned char *key, size_t len,
+			      const char *version)
+{
+	unsigned char buf[VERKEY_BUFSIZE];
+	unsigned char *key2;
+	size_t len2;
+	int diff;
 
-		v1s_len = v1s_end - v1s_start;
-		v2s_len = v2s_end - v2s_start;
+	len2 = psys_verkey_encode(version, buf, sizeof(buf));
+	if (!len2)
+		return -2;
+	else if (len2 <= sizeof(buf))
+		return psys_verkey_cmp(key, len, buf, len2);
 
-		diff = strncmp(v1s_start, v2s_start,
-			       (v1s_len > v2s_len) ? v1s_len : v2s_len);
-	} else {
-		if (v1s_isdigit)
-			diff = 1;
-		else
-			diff = -1;
-	}
+	/* If we are out of memory, consider the version newer */
+	key2 = psys_malloc(len2);
+	if (!key2)
+		return -1;
 
-	if (diff)
-		return diff;
-	else {
-		if (*v1s_end == '.')
-			v1s_end++;
-		if (*v2s_end == '.')
-			v2s_end++;
-		return psys_vercmp(v1s_end, v2s_end);
-	}
+	psys_verkey_encode(version, key2, len2);
+	diff = psys_verkey_cmp(key, len, key2, len2);
+	psys_free(key2);
+	return diff;
 }
 
 int psys_pkg_vercmp(psys_pkg_t pkg, const char *version)
 {
+	const unsigned char *key;
+	size_t len;
+	int diff;
+
 	assert(pkg != NULL);
 	assert(version != NULL);
-	assert_version_valid(psys_pkg_version(pkg));
+	key = psys_pkg_verkey(pkg, &len);
+	assert(key != NULL);
 
 	/*
 	 * If the version to compare to is not a valid psys package
@@ -336,30 +893,76 @@ int psys_pkg_vercmp(psys_pkg_t pkg, const char *version)
 	 * specific version of the package; we don't want installation
 	 * programs to overwrite those blindly. 
 	 */
-	if (!version_is_valid(version))
+	diff = verkey_cmp_version(key, len, version);
+	if (diff == -2)
 		return -1;
 	else
-		return psys_vercmp(psys_pkg_version(pkg), version);
+		return diff;
 }
 
 int psys_pkg_lsbvercmp(psys_pkg_t pkg, const char *lsbversion)
 {
+	unsigned char key[VERKEY_BUFSIZE];
+	size_t len;
+	int diff;
+
 	assert(pkg != NULL);
 	assert(lsbversion != NULL);
-	assert_lsbversion_valid(psys_pkg_lsbversion(pkg));
+	assert(lsbversion_is_valid(psys_pkg_lsbversion(pkg)));
+
+	len = psys_verkey_encode(psys_pkg_lsbversion(pkg), key, sizeof(key));
+	assert(len > 0 && len <= sizeof(key));
 
 	/*
 	 * Treat invalid passed versions as newer, just as in
 	 * psys_pkg_vercmp().
 	 */
-	if (!version_is_valid(lsbversion))
+	diff = verkey_cmp_version(key, len, lsbversion);
+	if (diff == -2)
 		return -1;
 	else
-		return psys_vercmp(lsbversion, psys_pkg_lsbversion(pkg));
+		return -diff;
+}
+
+/*** Looking up default translations ******************************************/
+
+const char *psys_tlist_default(psys_tlist_t list)
+{
+	/*
+	 * Translation lists of package objects always keep the "C"
+	 * translation first, if there is one
+	 */
+	if (list && !strcmp(psys_tlist_locale(list), "C"))
+		return psys_tlist_value(list);
+	else
+		return NULL;
 }
 
 /*** Setting errors ***********************************************************/
 
+/* Maximum size of the messages of thread-local error objects */
+#define ERR_SLOT_MSG_SIZE 256
+
+static int _err_mode = PSYS_ERR_HEAP;
+
+/*
+ * The error object returned in PSYS_ERR_THREAD mode. Each thread has its
+ * own, which is overwritten by the next error occuring in that thread.
+ */
+static __thread struct _psys_err _err_slot;
+static __thread char _err_slot_msg[ERR_SLOT_MSG_SIZE];
+
+int psys_err_mode(void)
+{
+	return _err_mode;
+}
+
+void psys_set_err_mode(int mode)
+{
+	assert(mode == PSYS_ERR_HEAP || mode == PSYS_ERR_THREAD);
+	_err_mode = mode;
+}
+
 void psys_err_set(psys_err_t *err, int code, const char *format, ...)
 {
 	if (err) {
@@ -368,22 +971,39 @@ void psys_err_set(psys_err_t *err, int code, const char *format, ...)
 
 		assert(format != NULL);
 
-		*err = malloc(sizeof(**err));
+		/*
+		 * The message is still formatted right away, as the
+		 * arguments might not outlive this call
+		 */
+		if (_err_mode == PSYS_ERR_THREAD) {
+			va_start(vl, format);
+			vsnprintf(_err_slot_msg, sizeof(_err_slot_msg), format,
+				  vl);
+			va_end(vl);
+
+			_err_slot.code = code;
+			_err_slot.msg = _err_slot_msg;
+			_err_slot.shared = 1;
+			*err = &_err_slot;
+			return;
+		}
+
+		*err = psys_malloc(sizeof(**err));
 		if (!(*err)) {
 			psys_err_set_nomem(err);
 			return;
 		}
+		(*err)->code = code;
+		(*err)->shared = 0;
 
 		va_start(vl, format);
-		rc = vasprintf(&((*err)->msg), format, vl);
+		rc = alloc_vasprintf(&((*err)->msg), format, vl);
 		va_end(vl);
 
 		if (rc < 0) {
 			psys_err_free(*err);
 			psys_err_set_nomem(err);
 		}
-
-		(*err)->code = code;
 	}
 }
 
@@ -401,6 +1021,132 @@ void psys_err_set_notimpl(psys_err_t *err)
 	psys_err_set(err, PSYS_ENOTIMPL, "Not implemented");
 }
 
+/*** Limiting resource usage ************************************************/
+
+/* See ioprio_set(2); glibc does not provide these */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+/*
+ * The resource policy is process-wide, like the hashing mode. A read rate
+ * or deadline of 0 means "unlimited".
+ */
+static unsigned long long _read_rate = 0;
+static int _hash_threads = 1;
+static int _ioprio_class = PSYS_IOPRIO_NONE;
+static int _ioprio_level = 0;
+static int _niceness_set = 0;
+static int _niceness = 0;
+static time_t _deadline = 0;
+
+/*
+ * Token bucket for the read rate limit. Readers take tokens for the bytes
+ * they have read and sleep off any resulting debt outside of the lock.
+ */
+static pthread_mutex_t _bucket_lock = PTHREAD_MUTEX_INITIALIZER;
+static double _bucket_tokens = 0;
+static struct timespec _bucket_last = {0, 0};
+
+void psys_set_read_rate(unsigned long long bytes_per_sec)
+{
+	pthread_mutex_lock(&_bucket_lock);
+	_read_rate = bytes_per_sec;
+	_bucket_tokens = 0;
+	_bucket_last.tv_sec = 0;
+	_bucket_last.tv_nsec = 0;
+	pthread_mutex_unlock(&_bucket_lock);
+}
+
+void psys_set_hash_threads(int nthreads)
+{
+	assert(nthreads > 0);
+	_hash_threads = nthreads;
+}
+
+void psys_set_io_priority(int ioclass, int level)
+{
+	assert(ioclass >= PSYS_IOPRIO_NONE && ioclass <= PSYS_IOPRIO_IDLE);
+	assert(level >= 0 && level <= 7);
+	_ioprio_class = ioclass;
+	_ioprio_level = level;
+}
+
+void psys_set_nice(int niceness)
+{
+	assert(niceness >= -20 && niceness <= 19);
+	_niceness = niceness;
+	_niceness_set = 1;
+}
+
+void psys_set_deadline(time_t deadline)
+{
+	_deadline = deadline;
+}
+
+static void throttle(size_t nbytes)
+{
+	struct timespec now;
+	double elapsed, debt;
+	unsigned long long rate;
+
+	rate = _read_rate;
+	if (!rate)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	lock_mutex(&_bucket_lock);
+	if (_bucket_last.tv_sec || _bucket_last.tv_nsec) {
+		elapsed = (now.tv_sec - _bucket_last.tv_sec) +
+			  (now.tv_nsec - _bucket_last.tv_nsec) / 1e9;
+		_bucket_tokens += elapsed * rate;
+	}
+	_bucket_last = now;
+
+	/* Allow bursts of at most one second worth of reading */
+	if (_bucket_tokens > rate)
+		_bucket_tokens = rate;
+	_bucket_tokens -= nbytes;
+	debt = (_bucket_tokens < 0) ? -_bucket_tokens / rate : 0;
+	unlock_mutex(&_bucket_lock);
+
+	if (debt > 0) {
+		struct timespec ts;
+
+		ts.tv_sec = (time_t) debt;
+		ts.tv_nsec = (long) ((debt - ts.tv_sec) * 1e9);
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+	}
+}
+
+static int check_deadline(psys_err_t *err)
+{
+	if (_deadline && time(NULL) >= _deadline) {
+		psys_err_set(err, PSYS_ETIMEOUT,
+			     "Deadline for processing package files exceeded");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Applies the I/O priority and niceness to the calling thread. On Linux,
+ * both are per-thread attributes, so this must only be called from
+ * threads we created ourselves.
+ */
+static void apply_thread_priority(void)
+{
+	if (_ioprio_class != PSYS_IOPRIO_NONE) {
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+			(_ioprio_class << IOPRIO_CLASS_SHIFT) | _ioprio_level);
+	}
+	if (_niceness_set) {
+		setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid),
+			    _niceness);
+	}
+}
+
 /*** Assembling package file lists ********************************************/
 
 static psys_flist_t flist_new(const char *path, const struct stat *st)
@@ -410,17 +1156,17 @@ static psys_flist_t flist_new(const char *path, const struct stat *st)
 	assert(path != NULL);
 	assert(st != NULL);
 
-	list = malloc(sizeof(*list));
+	list = psys_malloc(sizeof(*list));
 	if (!list)
 		return NULL;
 
-	list->path = strdup(path);
+	list->path = psys_strdup(path);
 	if (!list->path) {
 		psys_flist_free(list);
 		return NULL;
 	}
 
-	list->stat = malloc(sizeof(*list->stat));
+	list->stat = psys_malloc(sizeof(*list->stat));
 	if (!list->stat) {
 		psys_flist_free(list);
 		return NULL;
@@ -428,115 +1174,159 @@ static psys_flist_t flist_new(const char *path, const struct stat *st)
 		memcpy(list->stat, st, sizeof(*list->stat));
 	}
 
+	list->md5 = NULL;
 	list->next = NULL;
 	return list;
 }
 
-static int file_traversal_fn(const char *path, const struct stat *st,
-			     int type, struct FTW *ftw_s)
+/*
+ * The state of a file list under construction. psys_pkg_flist() keeps it
+ * on its own stack, so that several threads can assemble file lists at
+ * the same time.
+ */
+struct flist_builder {
+	psys_err_t *err;
+	psys_flist_t first;
+	psys_flist_t last;
+};
+
+static int builder_add(struct flist_builder *b, const char *path,
+		       const struct stat *st)
 {
 	psys_flist_t l;
 
-	switch (type) {
-	case FTW_DNR:
-		psys_err_set(_err, PSYS_EINTERNAL,
-			     "Not enough permission to access contents of "
-			     "directory `%s'");
-		return -1;
-
-	case FTW_NS:
-		psys_err_set(_err, PSYS_EINTERNAL,
-			     "Not enough permission to access file `%s'");
+	l = flist_new(path, st);
+	if (!l) {
+		psys_err_set_nomem(b->err);
 		return -1;
+	}
+	psys_stats_add(PSYS_STAT_FILES, 1);
 
-	default:
-		l = flist_new(path, st);
-		if (!l) {
-			psys_err_set_nomem(_err);
-			return -1;
-		}
-
-		if (_flist_last) {
-			_flist_last->next = l;
-			_flist_last = l;
-		} else {
-			assert(_flist == NULL);
-			_flist = _flist_last = l;
-		}
-
-		return 0;
+	if (b->last) {
+		b->last->next = l;
+		b->last = l;
+	} else {
+		assert(b->first == NULL);
+		b->first = b->last = l;
 	}
+
+	return 0;
 }
 
-static int add_extra(psys_plist_t extra)
+static int add_extra(struct flist_builder *b, psys_plist_t extra)
 {
 	const char *path;
 	struct stat st;
 
 	path = psys_plist_path(extra);
+	psys_stats_add(PSYS_STAT_SYSCALLS, 1);
 	if (lstat(path, &st)) {
 		/*
 		 * Ignore missing extra files. They _may_ be created, but
 		 * there is no obligation to necessarily do so.
 		 */
 		if (errno != ENOENT) {
-			psys_err_set(_err, PSYS_EINTERNAL,
+			psys_err_set(b->err, PSYS_EINTERNAL,
 				     "Cannot stat package file `%s': %s",
 				     path, strerror(errno));
 			return -1;
 		}
-	} else {
-		psys_flist_t l;
+		return 0;
+	}
 
-		l = flist_new(path, &st);
-		if (!l) {
-			psys_err_set_nomem(_err);
-			return -1;
-		}
+	return builder_add(b, path, &st);
+}
 
-		if (_flist_last) {
-			_flist_last->next = l;
-			_flist_last = l;
-		} else {
-			assert(_flist == NULL);
-			_flist = _flist_last = l;
+static int add_tree(struct flist_builder *b, const char *dir)
+{
+	char *paths[] = {(char *) dir, NULL};
+	FTSENT *ent;
+	FTS *fts;
+	int ret = -1;
+
+	fts = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
+	if (!fts) {
+		psys_err_set(b->err, PSYS_EINTERNAL,
+			     "Cannot traverse package directory `%s': %s",
+			     dir, strerror(errno));
+		return -1;
+	}
+
+	while ((ent = fts_read(fts))) {
+		if (check_deadline(b->err))
+			goto out;
+
+		/*
+		 * fts stats every entry, and opens, reads and closes every
+		 * directory
+		 */
+		psys_stats_add(PSYS_STAT_SYSCALLS,
+			       ent->fts_info == FTS_D ? 4 : 1);
+
+		switch (ent->fts_info) {
+		case FTS_DP:
+			/* Directories are added in preorder */
+			break;
+
+		case FTS_DNR:
+			psys_err_set(b->err, PSYS_EINTERNAL,
+				     "Not enough permission to access "
+				     "contents of directory `%s'",
+				     ent->fts_path);
+			goto out;
+
+		case FTS_NS:
+		case FTS_ERR:
+			psys_err_set(b->err, PSYS_EINTERNAL,
+				     "Cannot access package file `%s': %s",
+				     ent->fts_path,
+				     strerror(ent->fts_errno));
+			goto out;
+
+		default:
+			if (builder_add(b, ent->fts_path, ent->fts_statp))
+				goto out;
+			break;
 		}
 	}
 
-	return 0;		
+	if (errno) {
+		psys_err_set(b->err, PSYS_EINTERNAL,
+			     "Cannot traverse package directory `%s': %s",
+			     dir, strerror(errno));
+		goto out;
+	}
+
+	ret = 0;
+out:
+	fts_close(fts);
+	return ret;
 }
 
 psys_flist_t psys_pkg_flist(psys_pkg_t pkg, psys_err_t *err)
 {
-	psys_plist_t extras, e;
-	psys_flist_t list;
+	struct flist_builder b = {err, NULL, NULL};
+	struct psys_phase phase;
+	psys_plist_t e;
 
 	assert(pkg != NULL);
 
-	_pkg = pkg;
-	_err = err;
-
-	extras = psys_pkg_extras(pkg);
-	for (e = extras; e; e = psys_plist_next(e)) {
-		if (add_extra(e))
-			return NULL;
-	}
+	psys_phase_begin(&phase, PSYS_PHASE_WALK);
 
-	if (nftw(psys_pkg_dir(pkg), &file_traversal_fn, 4, FTW_PHYS)) {
-		if (err && !(*err))
-			psys_err_set(err, PSYS_EINTERNAL, strerror(errno));
-		psys_flist_free(_flist);
-		list = NULL;
-	} else {
-		list = _flist;
+	for (e = psys_pkg_extras(pkg); e; e = psys_plist_next(e)) {
+		if (add_extra(&b, e))
+			goto err;
 	}
 
-	_pkg = NULL;
-	_err = NULL;
-	_flist = NULL;
-	_flist_last = NULL;
+	if (add_tree(&b, psys_pkg_dir(pkg)))
+		goto err;
 
-	return list;
+	psys_phase_end(&phase);
+	return b.first;
+err:
+	psys_phase_end(&phase);
+	psys_flist_free(b.first);
+	return NULL;
 }
 
 /*** Working with package file lists ******************************************/
@@ -567,63 +1357,1663 @@ void psys_flist_free(psys_flist_t list)
 	while (l) {
 		next = l->next;
 		if (l->path)
-			free(l->path);
+			psys_free(l->path);
 		if (l->stat)
-			free(l->stat);
-		free(l);
+			psys_free(l->stat);
+		if (l->md5)
+			psys_free(l->md5);
+		psys_free(l);
 		l = next;
 	}
 }
 
 /*** Calculating MD5 sums *****************************************************/
 
-char *psys_flist_md5sum(psys_flist_t file, psys_err_t *err)
+/* Size of the read buffer used for hashing */
+#define HASH_BUFSIZE (128 * 1024)
+
+/*
+ * In PSYS_HASH_NOCACHE mode, we release the pages of the file being
+ * hashed every HASH_DROP_INTERVAL bytes instead of only at the end, so that
+ * a single huge file cannot flood the page cache either. The beginning of
+ * the next file is prefetched up to HASH_PREFETCH bytes.
+ */
+#define HASH_DROP_INTERVAL (8 * 1024 * 1024)
+#define HASH_PREFETCH (1024 * 1024)
+
+/* O_DIRECT requires the buffer to be aligned to the logical block size */
+#define HASH_DIRECT_ALIGN 4096
+
+static int _hash_mode = PSYS_HASH_DEFAULT;
+static int _hash_order = PSYS_HASH_ORDER_LIST;
+static unsigned long long _hash_bytes_read = 0;
+static unsigned long long _hash_pages_dropped = 0;
+
+int psys_hash_mode(void)
 {
-	char *cmd, *md5;
-	FILE *pipe;
+	return _hash_mode;
+}
 
-	if (S_ISREG(psys_flist_stat(file)->st_mode)) {
-		if (asprintf(&cmd, "md5sum %s", psys_flist_path(file)) < 0)
-			return NULL;
+void psys_set_hash_mode(int mode)
+{
+	assert(mode == PSYS_HASH_DEFAULT ||
+	       mode == PSYS_HASH_NOCACHE ||
+	       mode == PSYS_HASH_DIRECT);
+	_hash_mode = mode;
+}
 
-		pipe = popen(cmd, "r");
-		free(cmd);
-		if (!pipe) {
-			psys_err_set(err, PSYS_EINTERNAL,
-				     "Failed to run md5sum: %s",
-				     strerror(errno));
-			return NULL;
-		}
+int psys_hash_order(void)
+{
+	return _hash_order;
+}
 
-		md5 = malloc(33);
-		if (!md5) {
-			fclose(pipe);
-			psys_err_set_nomem(err);
-			return NULL;
+void psys_set_hash_order(int order)
+{
+	assert(order == PSYS_HASH_ORDER_LIST ||
+	       order == PSYS_HASH_ORDER_PHYSICAL);
+	_hash_order = order;
+}
+
+unsigned long long psys_hash_bytes_read(void)
+{
+	return __sync_fetch_and_add(&_hash_bytes_read, 0);
+}
+
+unsigned long long psys_hash_pages_dropped(void)
+{
+	return __sync_fetch_and_add(&_hash_pages_dropped, 0);
+}
+
+static void hash_drop_pages(int fd, off_t start, off_t end)
+{
+	long pagesize;
+
+	if (end <= start)
+		return;
+	if (posix_fadvise(fd, start, end - start, POSIX_FADV_DONTNEED))
+		return;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	__sync_fetch_and_add(&_hash_pages_dropped,
+			     (end - start + pagesize - 1) / pagesize);
+}
+
+static void hash_prefetch(psys_flist_t file)
+{
+	psys_flist_t f;
+	int fd;
+
+	/*
+	 * Find the next regular file in the list. In lists built with
+	 * psys_flist_prepend(), we may only know that a file has an MD5 sum.
+	 */
+	for (f = psys_flist_next(file); f; f = psys_flist_next(f)) {
+		if (f->stat ? S_ISREG(f->stat->st_mode) : f->md5 != NULL)
+			break;
+	}
+	if (!f)
+		return;
+
+	/*
+	 * The readahead is not cancelled by closing the file descriptor,
+	 * so there is no need to keep it open.
+	 */
+	fd = open(psys_flist_path(f), O_RDONLY | O_NOFOLLOW);
+	if (fd >= 0) {
+		posix_fadvise(fd, 0, HASH_PREFETCH, POSIX_FADV_WILLNEED);
+		close(fd);
+	}
+}
+
+static int hash_open(const char *path, int mode)
+{
+	int fd;
+
+	if (mode == PSYS_HASH_DIRECT) {
+		fd = open(path, O_RDONLY | O_NOFOLLOW | O_DIRECT);
+		/*
+		 * Some file systems (e.g. tmpfs) don't support O_DIRECT.
+		 * Fall back to a regular open in that case.
+		 */
+		if (fd >= 0 || errno != EINVAL)
+			return fd;
+	}
+	return open(path, O_RDONLY | O_NOFOLLOW);
+}
+
+static ssize_t hash_read(int fd, void *buf, size_t count)
+{
+	ssize_t n;
+
+	do {
+		n = read(fd, buf, count);
+		if (n < 0 && errno == EINVAL) {
+			int flags;
+
+			/*
+			 * The file system accepted O_DIRECT on open(), but
+			 * refuses direct reads. Switch to buffered reads.
+			 */
+			flags = fcntl(fd, F_GETFL);
+			if (flags < 0 || !(flags & O_DIRECT) ||
+			    fcntl(fd, F_SETFL, flags & ~O_DIRECT))
+				return -1;
+			n = read(fd, buf, count);
 		}
+	} while (n < 0 && errno == EINTR);
+
+	return n;
+}
 
-		if (!fgets(md5, 33, pipe)) {
-			char *reason;
+static int hash_file(psys_flist_t file, unsigned char digest[16],
+		     psys_err_t *err)
+{
+	const char *path;
+	struct psys_md5 md5;
+	void *raw, *buf;
+	int mode, fd, ret;
+	off_t offset, dropped;
+	unsigned long long nreads;
+	ssize_t n;
+
+	path = psys_flist_path(file);
+	mode = _hash_mode;
+	PSYS_PROBE2(hash__start, path,
+		    file->stat ? (long long) file->stat->st_size : -1LL);
+
+	ret = -1;
+	fd = -1;
+	offset = dropped = 0;
+	nreads = 0;
+
+	/* O_DIRECT reads need an aligned buffer */
+	raw = psys_malloc(HASH_BUFSIZE + HASH_DIRECT_ALIGN - 1);
+	if (!raw) {
+		psys_err_set_nomem(err);
+		goto out;
+	}
+	buf = (void *) (((uintptr_t) raw + HASH_DIRECT_ALIGN - 1) &
+			~(uintptr_t) (HASH_DIRECT_ALIGN - 1));
+
+	fd = hash_open(path, mode);
+	if (fd < 0) {
+		psys_err_set(err, PSYS_EINTERNAL,
+			     "Cannot open file `%s': %s",
+			     path, strerror(errno));
+		goto out;
+	}
 
-			if (feof(pipe))
-				reason = "Unexpected end of stream";
-			else
-				reason = strerror(errno);
+	if (mode != PSYS_HASH_DEFAULT)
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if (mode == PSYS_HASH_NOCACHE)
+		hash_prefetch(file);
 
-			psys_err_set(err, PSYS_EINTERNAL,
-				     "Failed to read checksum for file `%s' "
-				     "from md5sum: %s",
-				     psys_flist_path(file), reason);
+	psys_md5_init(&md5);
+
+	while ((n = hash_read(fd, buf, HASH_BUFSIZE)) > 0) {
+		psys_md5_update(&md5, buf, n);
+		offset += n;
+		nreads++;
 
-			pclose(pipe);
-			free(md5);
-			return NULL;
+		throttle(n);
+		if (check_deadline(err))
+			goto out;
+
+		if (mode != PSYS_HASH_DEFAULT &&
+		    offset - dropped >= HASH_DROP_INTERVAL) {
+			hash_drop_pages(fd, dropped, offset);
+			dropped = offset;
 		}
+	}
 
-		fclose(pipe);
-	} else {
-		md5 = "";
+	if (n < 0) {
+		psys_err_set(err, PSYS_EINTERNAL,
+			     "Cannot read file `%s': %s",
+			     path, strerror(errno));
+		goto out;
+	}
+
+	if (mode != PSYS_HASH_DEFAULT)
+		hash_drop_pages(fd, dropped, offset);
+	__sync_fetch_and_add(&_hash_bytes_read, offset);
+
+	/* open(), the reads including the final one and close() */
+	psys_stats_add(PSYS_STAT_SYSCALLS, nreads + 3);
+	psys_stats_add(PSYS_STAT_BYTES_HASHED, offset);
+
+	psys_md5_final(&md5, digest);
+	ret = 0;
+out:
+	if (fd >= 0)
+		close(fd);
+	psys_free(raw);
+	PSYS_PROBE3(hash__done, path, (long long) offset, ret);
+	return ret;
+}
+
+static char *md5_hex(psys_flist_t file, psys_err_t *err)
+{
+	unsigned char digest[16];
+	char *md5;
+	int i;
+
+	if (hash_file(file, digest, err))
+		return NULL;
+
+	md5 = psys_malloc(33);
+	if (!md5) {
+		psys_err_set_nomem(err);
+		return NULL;
 	}
 
+	for (i = 0; i < 16; i++)
+		sprintf(md5 + i * 2, "%02x", digest[i]);
 	return md5;
 }
+
+/*
+ * Sort key for hashing files in the order they are laid out on disk. On
+ * rotational disks, this turns the random reads of directory order into
+ * a mostly sequential sweep.
+ */
+struct hash_order_key {
+	psys_flist_t file;
+	dev_t dev;
+	int physical;
+	unsigned long long pos;
+};
+
+static void hash_order_key_init(struct hash_order_key *key, psys_flist_t file)
+{
+	union {
+		struct fiemap fm;
+		char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} u;
+	const struct stat *st;
+	int fd;
+
+	st = psys_flist_stat(file);
+	key->file = file;
+	key->dev = st->st_dev;
+	key->physical = 0;
+	key->pos = st->st_ino;
+
+	/*
+	 * Ask for the file's first extent. If the file system does not
+	 * support FIEMAP, the inode number is the next best guess as most
+	 * file systems allocate data close to the inode.
+	 */
+	fd = open(psys_flist_path(file), O_RDONLY | O_NOFOLLOW);
+	if (fd < 0)
+		return;
+
+	memset(&u, 0, sizeof(u));
+	u.fm.fm_start = 0;
+	u.fm.fm_length = ~0ULL;
+	u.fm.fm_extent_count = 1;
+	if (!ioctl(fd, FS_IOC_FIEMAP, &u.fm) && u.fm.fm_mapped_extents) {
+		key->physical = 1;
+		key->pos = u.fm.fm_extents[0].fe_physical;
+	}
+	close(fd);
+}
+
+static int hash_order_key_cmp(const void *a, const void *b)
+{
+	const struct hash_order_key *k1 = a, *k2 = b;
+
+	if (k1->dev != k2->dev)
+		return (k1->dev < k2->dev) ? -1 : 1;
+	if (k1->physical != k2->physical)
+		return k2->physical - k1->physical;
+	if (k1->pos != k2->pos)
+		return (k1->pos < k2->pos) ? -1 : 1;
+	return 0;
+}
+
+static int sort_by_physical_order(psys_flist_t *files, size_t nfiles)
+{
+	struct hash_order_key *keys;
+	size_t i;
+
+	keys = psys_malloc(nfiles * sizeof(*keys));
+	if (!keys)
+		return -1;
+
+	for (i = 0; i < nfiles; i++)
+		hash_order_key_init(&keys[i], files[i]);
+	qsort(keys, nfiles, sizeof(*keys), hash_order_key_cmp);
+	for (i = 0; i < nfiles; i++)
+		files[i] = keys[i].file;
+
+	psys_free(keys);
+	return 0;
+}
+
+/*
+ * Work on a file list shared by a pool of threads. Each file is passed to
+ * fn exactly once; the first error stops all threads. This is used by
+ * psys_flist_md5sums() and psys_flist_verify().
+ */
+struct flist_job {
+	pthread_mutex_t lock;
+	psys_flist_t *files;
+	size_t nfiles;
+	size_t next;
+	int (*fn)(struct flist_job *job, size_t i, psys_err_t *err);
+	void *data;
+	psys_err_t err;
+	int failed;
+
+	/* Statistics object of the calling thread, and the phase to charge */
+	psys_stats_t stats;
+	int phase;
+
+	/* Name of the worker threads' trace spans */
+	const char *worker_name;
+
+	/* Copy of a thread-local error, which dies with its worker */
+	int err_code;
+	char err_msg[ERR_SLOT_MSG_SIZE];
+};
+
+static void *flist_worker(void *data)
+{
+	struct flist_job *job;
+
+	job = data;
+	apply_thread_priority();
+
+	while (1) {
+		psys_err_t err = NULL;
+		size_t i;
+
+		lock_mutex(&job->lock);
+		if (job->failed || job->next == job->nfiles) {
+			unlock_mutex(&job->lock);
+			break;
+		}
+		i = job->next++;
+		unlock_mutex(&job->lock);
+
+		if ((*job->fn)(job, i, &err)) {
+			lock_mutex(&job->lock);
+			if (!job->failed) {
+				job->failed = 1;
+				job->err = err;
+				if (err == &_err_slot) {
+					job->err = NULL;
+					job->err_code = err->code;
+					strcpy(job->err_msg, err->msg);
+				}
+			} else {
+				psys_err_free(err);
+			}
+			unlock_mutex(&job->lock);
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Entry point of the worker threads. Their counters go to the statistics
+ * object of the thread which runs the job, and their CPU time is charged
+ * to the job's phase.
+ */
+static void *flist_thread(void *data)
+{
+	struct flist_job *job;
+	struct psys_span span;
+	struct timespec cpu;
+
+	job = data;
+	psys_stats_attach(job->stats);
+
+	psys_span_begin(&span, job->worker_name);
+	flist_worker(job);
+	psys_span_end(&span);
+
+	if (job->stats && job->phase >= 0) {
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+		__atomic_fetch_add(&job->stats->cpu_ns[job->phase],
+				   timespec_ns(&cpu), __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+static int flist_job_run(struct flist_job *job, psys_err_t *err)
+{
+	pthread_t *threads;
+	int nthreads, started, i;
+
+	pthread_mutex_init(&job->lock, NULL);
+	job->next = 0;
+	job->err = NULL;
+	job->failed = 0;
+	job->stats = _stats;
+
+	nthreads = _hash_threads;
+	if (nthreads > job->nfiles)
+		nthreads = job->nfiles;
+
+	threads = psys_malloc(nthreads * sizeof(*threads));
+	if (!threads) {
+		pthread_mutex_destroy(&job->lock);
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	started = 0;
+	while (started < nthreads) {
+		if (pthread_create(&threads[started], NULL, flist_thread, job))
+			break;
+		started++;
+	}
+
+	/* If we could not start any thread, do the work ourselves */
+	if (!started)
+		flist_worker(job);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	psys_free(threads);
+	pthread_mutex_destroy(&job->lock);
+
+	if (job->failed) {
+		if (!job->err)
+			psys_err_set(err, job->err_code, "%s", job->err_msg);
+		else if (err)
+			*err = job->err;
+		else
+			psys_err_free(job->err);
+		return -1;
+	}
+	return 0;
+}
+
+static int md5sums_fn(struct flist_job *job, size_t i, psys_err_t *err)
+{
+	psys_flist_t f;
+
+	f = job->files[i];
+	f->md5 = md5_hex(f, err);
+	return f->md5 ? 0 : -1;
+}
+
+int psys_flist_md5sums(psys_flist_t list, psys_err_t *err)
+{
+	struct flist_job job;
+	struct psys_phase phase;
+	psys_flist_t f;
+	size_t i;
+	int ret;
+
+	job.nfiles = 0;
+	for (f = list; f; f = psys_flist_next(f)) {
+		if (S_ISREG(psys_flist_stat(f)->st_mode) && !f->md5)
+			job.nfiles++;
+	}
+	if (!job.nfiles)
+		return 0;
+
+	job.files = psys_malloc(job.nfiles * sizeof(*job.files));
+	if (!job.files) {
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	i = 0;
+	for (f = list; f; f = psys_flist_next(f)) {
+		if (S_ISREG(psys_flist_stat(f)->st_mode) && !f->md5)
+			job.files[i++] = f;
+	}
+
+	if (_hash_order == PSYS_HASH_ORDER_PHYSICAL &&
+	    sort_by_physical_order(job.files, job.nfiles)) {
+		psys_free(job.files);
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	job.fn = md5sums_fn;
+	job.data = NULL;
+	job.phase = PSYS_PHASE_HASH;
+	job.worker_name = "hash_worker";
+
+	psys_phase_begin(&phase, PSYS_PHASE_HASH);
+	ret = flist_job_run(&job, err);
+	psys_phase_end(&phase);
+
+	psys_free(job.files);
+	return ret;
+}
+
+char *psys_flist_md5sum(psys_flist_t file, psys_err_t *err)
+{
+	char *md5;
+
+	if (S_ISREG(psys_flist_stat(file)->st_mode)) {
+		/* Already calculated by psys_flist_md5sums()? */
+		if (file->md5) {
+			md5 = psys_strdup(file->md5);
+			if (!md5)
+				psys_err_set_nomem(err);
+		} else {
+			md5 = md5_hex(file, err);
+		}
+	} else {
+		/* No checksum, but still freeable with psys_free() */
+		md5 = psys_strdup("");
+		if (!md5)
+			psys_err_set_nomem(err);
+	}
+
+	return md5;
+}
+
+/*** Verifying package files **************************************************/
+
+struct verify_data {
+	int mode;
+	int *problems;
+};
+
+static int verify_fn(struct flist_job *job, size_t i, psys_err_t *err)
+{
+	struct verify_data *vd;
+	psys_flist_t f;
+	const struct stat *expected;
+	struct stat st;
+	int problems;
+
+	vd = job->data;
+	f = job->files[i];
+	expected = f->stat;
+
+	if (check_deadline(err))
+		return -1;
+
+	if (lstat(f->path, &st)) {
+		if (errno == ENOENT || errno == ENOTDIR) {
+			vd->problems[i] = PSYS_VERIFY_MISSING;
+			return 0;
+		}
+		psys_err_set(err, PSYS_EINTERNAL,
+			     "Cannot stat package file `%s': %s",
+			     f->path, strerror(errno));
+		return -1;
+	}
+
+	problems = 0;
+	if (expected) {
+		if ((expected->st_mode & (S_IFMT | 07777)) !=
+		    (st.st_mode & (S_IFMT | 07777)))
+			problems |= PSYS_VERIFY_MODE;
+		if (S_ISREG(expected->st_mode) && S_ISREG(st.st_mode) &&
+		    expected->st_size != st.st_size)
+			problems |= PSYS_VERIFY_MODIFIED;
+	}
+
+	/*
+	 * Only hash files which are still regular files and which we have
+	 * not already found to be modified.
+	 */
+	if (vd->mode == PSYS_VERIFY_CONTENT && f->md5 &&
+	    S_ISREG(st.st_mode) && !(problems & PSYS_VERIFY_MODIFIED)) {
+		unsigned char digest[16];
+		char md5[33];
+		int j;
+
+		if (hash_file(f, digest, err))
+			return -1;
+
+		for (j = 0; j < 16; j++)
+			sprintf(md5 + j * 2, "%02x", digest[j]);
+		if (strcasecmp(md5, f->md5))
+			problems |= PSYS_VERIFY_MODIFIED;
+	}
+
+	vd->problems[i] = problems;
+	return 0;
+}
+
+psys_flist_t psys_flist_prepend(psys_flist_t list, const char *path,
+				const struct stat *st, const char *md5)
+{
+	psys_flist_t elem;
+
+	assert(path != NULL);
+
+	elem = psys_malloc(sizeof(*elem));
+	if (!elem)
+		return NULL;
+
+	elem->path = psys_strdup(path);
+	elem->stat = NULL;
+	elem->md5 = NULL;
+	elem->next = NULL;
+	if (!elem->path)
+		goto nomem;
+
+	if (st) {
+		elem->stat = psys_malloc(sizeof(*elem->stat));
+		if (!elem->stat)
+			goto nomem;
+		memcpy(elem->stat, st, sizeof(*elem->stat));
+	}
+
+	/* Empty MD5 sums are recorded for non-regular files */
+	if (md5 && *md5) {
+		elem->md5 = psys_strdup(md5);
+		if (!elem->md5)
+			goto nomem;
+	}
+
+	elem->next = list;
+	return elem;
+
+nomem:
+	psys_flist_free(elem);
+	return NULL;
+}
+
+int psys_flist_verify(psys_flist_t list, int mode, psys_verify_fn fn,
+		      void *data, psys_err_t *err)
+{
+	struct flist_job job;
+	struct verify_data vd;
+	psys_flist_t f;
+	size_t i;
+	int count;
+
+	assert(mode == PSYS_VERIFY_STAT || mode == PSYS_VERIFY_CONTENT);
+
+	job.nfiles = 0;
+	for (f = list; f; f = psys_flist_next(f))
+		job.nfiles++;
+	if (!job.nfiles)
+		return 0;
+
+	job.files = psys_malloc(job.nfiles * sizeof(*job.files));
+	vd.problems = psys_calloc(job.nfiles, sizeof(*vd.problems));
+	if (!job.files || !vd.problems) {
+		psys_free(job.files);
+		psys_free(vd.problems);
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	i = 0;
+	for (f = list; f; f = psys_flist_next(f))
+		job.files[i++] = f;
+
+	vd.mode = mode;
+	job.fn = verify_fn;
+	job.data = &vd;
+	job.phase = -1;
+	job.worker_name = "verify_worker";
+	if (flist_job_run(&job, err)) {
+		psys_free(job.files);
+		psys_free(vd.problems);
+		return -1;
+	}
+
+	/*
+	 * Report from the calling thread so that the callback does not need
+	 * to be thread-safe.
+	 */
+	count = 0;
+	for (i = 0; i < job.nfiles; i++) {
+		if (vd.problems[i]) {
+			count++;
+			if (fn && (*fn)(job.files[i]->path, vd.problems[i], data))
+				break;
+		}
+	}
+
+	psys_free(job.files);
+	psys_free(vd.problems);
+	return count;
+}
+
+/*** Indexing package file owners *********************************************/
+
+/*
+ * An owner index is a text file with one "<path>\t<vendor>\t<name>\n" line
+ * per package file, sorted by path and then by owner. Because the lines
+ * are sorted, a path can be looked up by bisecting the mapped file without
+ * parsing it first. Paths containing tabs or newlines cannot be represented
+ * and are not indexed.
+ *
+ * Next to the index, a Bloom filter over all indexed paths is kept in
+ * "<index>.bloom", so that lookups of paths not in the index (which is
+ * the common case for conflict checks) usually do not need to touch the
+ * index at all. The filter is written in host byte order and identifies
+ * the index file it was built for by device, inode, size and modification
+ * time; if these do not match the index, the filter is ignored. A new
+ * index is written to a temporary file which is renamed into place, so the
+ * filter can be saved for the temporary file before the index is replaced.
+ */
+
+struct _psys_index {
+	const char *data;
+	size_t size;
+
+	/* Bloom filter (NULL if unavailable) */
+	void *filter;
+	size_t filter_size;
+	const unsigned char *bits;
+	uint64_t mask;
+	unsigned int nhashes;
+};
+
+struct index_entry {
+	const char *path;
+	size_t path_len;
+	const char *owner;
+	size_t owner_len;
+};
+
+#define BLOOM_MAGIC "PSYSBLM2"
+
+/* About 1% false positives with 10 bits per path and 7 hash functions */
+#define BLOOM_BITS_PER_PATH 10
+#define BLOOM_NHASHES 7
+
+struct bloom_header {
+	char magic[8];
+	uint64_t index_dev;
+	uint64_t index_ino;
+	uint64_t index_size;
+	int64_t index_mtime_sec;
+	int64_t index_mtime_nsec;
+	uint32_t log2_bits;
+	uint32_t nhashes;
+};
+
+struct bloom {
+	unsigned char *bits;
+	uint32_t log2_bits;
+};
+
+/* FNV-1a, followed by a final mix to spread the bits */
+static uint64_t bloom_hash(const char *s, size_t len)
+{
+	uint64_t h = 14695981039346656037ULL;
+
+	while (len--) {
+		h ^= (unsigned char) *s++;
+		h *= 1099511628211ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static int bloom_init(struct bloom *b, size_t npaths)
+{
+	uint64_t nbits;
+
+	b->log2_bits = 10;
+	nbits = (uint64_t) npaths * BLOOM_BITS_PER_PATH;
+	while ((1ULL << b->log2_bits) < nbits && b->log2_bits < 40)
+		b->log2_bits++;
+
+	b->bits = psys_calloc(1, (1ULL << b->log2_bits) / 8);
+	return b->bits ? 0 : -1;
+}
+
+/*
+ * The hash functions are derived from a single 64-bit hash by double
+ * hashing (h1 + i * h2), see Kirsch and Mitzenmacher, "Less Hashing, Same
+ * Performance: Building a Better Bloom Filter"
+ */
+static void bloom_add(struct bloom *b, const char *path, size_t len)
+{
+	uint64_t h, h1, h2, mask;
+	unsigned int i;
+
+	h = bloom_hash(path, len);
+	h1 = h & 0xffffffffULL;
+	h2 = (h >> 32) | 1;
+	mask = (1ULL << b->log2_bits) - 1;
+
+	for (i = 0; i < BLOOM_NHASHES; i++) {
+		uint64_t bit = (h1 + i * h2) & mask;
+		b->bits[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+static int bloom_test(psys_index_t idx, const char *path, size_t len)
+{
+	uint64_t h, h1, h2;
+	unsigned int i;
+
+	h = bloom_hash(path, len);
+	h1 = h & 0xffffffffULL;
+	h2 = (h >> 32) | 1;
+
+	for (i = 0; i < idx->nhashes; i++) {
+		uint64_t bit = (h1 + i * h2) & idx->mask;
+		if (!(idx->bits[bit / 8] & (1 << (bit % 8))))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Creates a temporary file next to `path' from which to replace it, and
+ * stores the temporary file's name (to be freed with psys_free()) in *tmp
+ */
+static FILE *tmp_create(const char *path, char **tmp, psys_err_t *err)
+{
+	FILE *out;
+	int fd;
+
+	if (psys_asprintf(tmp, "%s.XXXXXX", path) < 0) {
+		*tmp = NULL;
+		psys_err_set_nomem(err);
+		return NULL;
+	}
+
+	fd = mkstemp(*tmp);
+	if (fd < 0) {
+		psys_err_set(err, (errno == EACCES) ? PSYS_EACCESS :
+						       PSYS_EINTERNAL,
+			     "Cannot create `%s': %s", *tmp, strerror(errno));
+		psys_free(*tmp);
+		*tmp = NULL;
+		return NULL;
+	}
+	fchmod(fd, 0644);
+	out = fdopen(fd, "w");
+	if (!out) {
+		close(fd);
+		unlink(*tmp);
+		psys_free(*tmp);
+		*tmp = NULL;
+		psys_err_set_nomem(err);
+		return NULL;
+	}
+	return out;
+}
+
+/* Returns whether the filter header `hdr' was written for the index `st' */
+static int bloom_matches(const struct bloom_header *hdr, const struct stat *st)
+{
+	return hdr->index_dev == (uint64_t) st->st_dev &&
+	       hdr->index_ino == (uint64_t) st->st_ino &&
+	       hdr->index_size == (uint64_t) st->st_size &&
+	       hdr->index_mtime_sec == (int64_t) st->st_mtim.tv_sec &&
+	       hdr->index_mtime_nsec == (int64_t) st->st_mtim.tv_nsec;
+}
+
+/* Saves the filter `b' for the index file described by `st' */
+static int bloom_save(struct bloom *b, const char *index,
+		      const struct stat *st, psys_err_t *err)
+{
+	struct bloom_header hdr;
+	char *path = NULL;
+	char *tmp = NULL;
+	FILE *out = NULL;
+	int ret;
+
+	if (psys_asprintf(&path, "%s.bloom", index) < 0) {
+		path = NULL;
+		psys_err_set_nomem(err);
+		ret = -1;
+		goto out;
+	}
+
+	out = tmp_create(path, &tmp, err);
+	if (!out) {
+		ret = -1;
+		goto out;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, BLOOM_MAGIC, sizeof(hdr.magic));
+	hdr.index_dev = st->st_dev;
+	hdr.index_ino = st->st_ino;
+	hdr.index_size = st->st_size;
+	hdr.index_mtime_sec = st->st_mtim.tv_sec;
+	hdr.index_mtime_nsec = st->st_mtim.tv_nsec;
+	hdr.log2_bits = b->log2_bits;
+	hdr.nhashes = BLOOM_NHASHES;
+
+	fwrite(&hdr, sizeof(hdr), 1, out);
+	fwrite(b->bits, 1, (1ULL << b->log2_bits) / 8, out);
+	if (fflush(out) || ferror(out) || fsync(fileno(out))) {
+		psys_err_set(err, PSYS_EINTERNAL, "Cannot write `%s': %s",
+			     tmp, strerror(errno));
+		ret = -1;
+		goto out;
+	}
+
+	if (rename(tmp, path)) {
+		psys_err_set(err, PSYS_EINTERNAL, "Cannot rename `%s': %s",
+			     tmp, strerror(errno));
+		ret = -1;
+		goto out;
+	}
+	psys_free(tmp);
+	tmp = NULL;
+
+	ret = 0;
+out:
+	if (out)
+		fclose(out);
+	if (tmp) {
+		unlink(tmp);
+		psys_free(tmp);
+	}
+	psys_free(path);
+	return ret;
+}
+
+static int index_bytes_cmp(const char *a, size_t alen, const char *b,
+			   size_t blen)
+{
+	int diff;
+
+	diff = memcmp(a, b, (alen < blen) ? alen : blen);
+	if (diff)
+		return diff;
+	return (alen > blen) - (alen < blen);
+}
+
+static int index_entry_cmp(const void *a, const void *b)
+{
+	const struct index_entry *ea = a;
+	const struct index_entry *eb = b;
+	int diff;
+
+	diff = index_bytes_cmp(ea->path, ea->path_len, eb->path, eb->path_len);
+	if (diff)
+		return diff;
+	return index_bytes_cmp(ea->owner, ea->owner_len,
+			       eb->owner, eb->owner_len);
+}
+
+/* Parses the line at `line' and returns the start of the next one */
+static const char *index_parse(const char *line, const char *end,
+			       struct index_entry *e)
+{
+	const char *tab, *eol;
+
+	eol = memchr(line, '\n', end - line);
+	if (!eol)
+		eol = end;
+	tab = memchr(line, '\t', eol - line);
+	if (!tab)
+		tab = eol;
+
+	e->path = line;
+	e->path_len = tab - line;
+	e->owner = (tab < eol) ? tab + 1 : eol;
+	e->owner_len = eol - e->owner;
+	return (eol < end) ? eol + 1 : end;
+}
+
+/*
+ * Maps the file `path' (if it exists) and stores its status in *stp unless
+ * stp is NULL
+ */
+static int index_map(const char *path, void **data, size_t *size,
+		     struct stat *stp, psys_err_t *err)
+{
+	struct stat st;
+	int fd;
+
+	*data = NULL;
+	*size = 0;
+	if (stp)
+		memset(stp, 0, sizeof(*stp));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		psys_err_set(err, (errno == EACCES) ? PSYS_EACCESS :
+						       PSYS_EINTERNAL,
+			     "Cannot open `%s': %s", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st)) {
+		psys_err_set(err, PSYS_EINTERNAL, "Cannot stat `%s': %s",
+			     path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_size > 0) {
+		void *map;
+
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			psys_err_set(err, PSYS_EINTERNAL,
+				     "Cannot map `%s': %s",
+				     path, strerror(errno));
+			close(fd);
+			return -1;
+		}
+		*data = map;
+		*size = st.st_size;
+	}
+
+	if (stp)
+		*stp = st;
+	close(fd);
+	return 0;
+}
+
+static size_t index_count(const char *data, size_t size)
+{
+	const char *p, *end;
+	size_t n;
+
+	n = 0;
+	end = data + size;
+	for (p = data; p < end; p++) {
+		p = memchr(p, '\n', end - p);
+		if (!p)
+			break;
+		n++;
+	}
+	return n;
+}
+
+psys_index_t psys_index_open(const char *index, psys_err_t *err)
+{
+	psys_index_t idx;
+	const struct bloom_header *hdr;
+	struct stat st;
+	char *filter_path;
+	void *data;
+
+	assert(index != NULL);
+
+	idx = psys_calloc(1, sizeof(*idx));
+	if (!idx) {
+		psys_err_set_nomem(err);
+		return NULL;
+	}
+
+	/* A missing index is treated as empty */
+	if (index_map(index, &data, &idx->size, &st, err)) {
+		psys_free(idx);
+		return NULL;
+	}
+	idx->data = data;
+
+	/* A missing or unusable filter only makes lookups slower */
+	if (psys_asprintf(&filter_path, "%s.bloom", index) < 0)
+		return idx;
+	if (index_map(filter_path, &idx->filter, &idx->filter_size, NULL,
+		      NULL)) {
+		psys_free(filter_path);
+		return idx;
+	}
+	psys_free(filter_path);
+
+	hdr = idx->filter;
+	if (idx->filter && idx->filter_size >= sizeof(*hdr) &&
+	    !memcmp(hdr->magic, BLOOM_MAGIC, sizeof(hdr->magic)) &&
+	    bloom_matches(hdr, &st) && hdr->log2_bits >= 3 &&
+	    hdr->log2_bits <= 40 && hdr->nhashes > 0 &&
+	    idx->filter_size - sizeof(*hdr) >= (1ULL << hdr->log2_bits) / 8) {
+		idx->bits = (const unsigned char *) (hdr + 1);
+		idx->mask = (1ULL << hdr->log2_bits) - 1;
+		idx->nhashes = hdr->nhashes;
+	}
+
+	return idx;
+}
+
+int psys_index_find(psys_index_t idx, const char *path, psys_index_fn fn,
+		    void *data, psys_err_t *err)
+{
+	const char *lo, *hi, *end;
+	size_t path_len;
+	int ret;
+
+	assert(idx != NULL);
+	assert(path != NULL);
+	assert(fn != NULL);
+
+	path_len = strlen(path);
+	if (!idx->data || (idx->bits && !bloom_test(idx, path, path_len)))
+		return 0;
+
+	/* Find the first line whose path is not less than `path' */
+	lo = idx->data;
+	hi = end = idx->data + idx->size;
+	while (lo < hi) {
+		struct index_entry e;
+		const char *line, *next;
+
+		line = lo + (hi - lo) / 2;
+		while (line > lo && line[-1] != '\n')
+			line--;
+
+		next = index_parse(line, end, &e);
+		if (index_bytes_cmp(e.path, e.path_len, path, path_len) < 0)
+			lo = next;
+		else
+			hi = line;
+	}
+
+	ret = 0;
+	while (lo < end && !ret) {
+		struct index_entry e;
+		const char *tab;
+		char *vendor, *name;
+
+		lo = index_parse(lo, end, &e);
+		if (index_bytes_cmp(e.path, e.path_len, path, path_len))
+			break;
+
+		tab = memchr(e.owner, '\t', e.owner_len);
+		if (!tab)
+			continue;
+
+		vendor = psys_strndup(e.owner, tab - e.owner);
+		name = psys_strndup(tab + 1, e.owner + e.owner_len - tab - 1);
+		if (!vendor || !name) {
+			psys_err_set_nomem(err);
+			ret = -1;
+		} else {
+			ret = (*fn)(vendor, name, data);
+		}
+		psys_free(vendor);
+		psys_free(name);
+	}
+
+	return ret;
+}
+
+void psys_index_close(psys_index_t idx)
+{
+	if (idx) {
+		if (idx->data)
+			munmap((void *) idx->data, idx->size);
+		if (idx->filter)
+			munmap(idx->filter, idx->filter_size);
+		psys_free(idx);
+	}
+}
+
+int psys_index_lookup(const char *index, const char *path, psys_index_fn fn,
+		      void *data, psys_err_t *err)
+{
+	psys_index_t idx;
+	int ret;
+
+	idx = psys_index_open(index, err);
+	if (!idx)
+		return -1;
+
+	ret = psys_index_find(idx, path, fn, data, err);
+	psys_index_close(idx);
+	return ret;
+}
+
+static int index_write(FILE *out, struct bloom *b,
+		       const struct index_entry *e)
+{
+	bloom_add(b, e->path, e->path_len);
+
+	fwrite(e->path, 1, e->path_len, out);
+	putc('\t', out);
+	fwrite(e->owner, 1, e->owner_len, out);
+	return (putc('\n', out) == EOF) ? -1 : 0;
+}
+
+/*
+ * Flushes the new index written to the temporary file `tmp' (see
+ * tmp_create()) and saves the filter `b' for it, then replaces `index'
+ */
+static int index_commit(const char *index, const char *tmp, FILE *out,
+			struct bloom *b, psys_err_t *err)
+{
+	struct stat st;
+
+	if (fflush(out) || ferror(out) || fsync(fileno(out)) ||
+	    fstat(fileno(out), &st)) {
+		psys_err_set(err, PSYS_EINTERNAL, "Cannot write `%s': %s",
+			     tmp, strerror(errno));
+		return -1;
+	}
+
+	/*
+	 * Replace the filter first, for the temporary file, which keeps
+	 * its inode and modification time when renamed. If we fail in
+	 * between, the filter is ignored because it does not match the
+	 * old index.
+	 */
+	if (bloom_save(b, index, &st, err))
+		return -1;
+
+	if (rename(tmp, index)) {
+		psys_err_set(err, PSYS_EINTERNAL, "Cannot rename `%s': %s",
+			     tmp, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Returns whether `owner' is in the sorted array `owners' */
+static int owner_listed(char **owners, size_t nowners, const char *owner,
+			size_t owner_len)
+{
+	size_t lo, hi;
+
+	lo = 0;
+	hi = nowners;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int diff;
+
+		diff = index_bytes_cmp(owners[mid], strlen(owners[mid]),
+				       owner, owner_len);
+		if (!diff)
+			return 1;
+		if (diff < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return 0;
+}
+
+static int owner_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * Rewrites `index', dropping the entries of the owners in the sorted array
+ * `owners' and merging in the sorted array `entries'
+ */
+static int index_rewrite(const char *index, char **owners, size_t nowners,
+			 const struct index_entry *entries, size_t n,
+			 psys_err_t *err)
+{
+	struct index_entry old;
+	struct bloom bloom = {NULL, 0};
+	void *map = NULL;
+	const char *p, *next, *end;
+	char *tmp = NULL;
+	FILE *out = NULL;
+	size_t size, i;
+	int have_old, ret;
+
+	if (index_map(index, &map, &size, NULL, err)) {
+		ret = -1;
+		goto out;
+	}
+
+	if (bloom_init(&bloom, index_count(map, size) + n)) {
+		psys_err_set_nomem(err);
+		ret = -1;
+		goto out;
+	}
+
+	out = tmp_create(index, &tmp, err);
+	if (!out) {
+		ret = -1;
+		goto out;
+	}
+
+	/*
+	 * Merge the new entries into the old index, dropping the old
+	 * entries of the owners on the way
+	 */
+	p = map;
+	end = p + size;
+	next = p;
+	have_old = 0;
+	i = 0;
+	for (;;) {
+		if (!have_old && p < end) {
+			next = index_parse(p, end, &old);
+			if (owner_listed(owners, nowners, old.owner,
+					 old.owner_len)) {
+				p = next;
+				continue;
+			}
+			have_old = 1;
+		}
+
+		if (i < n && (!have_old ||
+			      index_entry_cmp(&entries[i], &old) <= 0)) {
+			if (!i || index_entry_cmp(&entries[i],
+						  &entries[i - 1]))
+				index_write(out, &bloom, &entries[i]);
+			i++;
+		} else if (have_old) {
+			index_write(out, &bloom, &old);
+			have_old = 0;
+			p = next;
+		} else {
+			break;
+		}
+	}
+
+	if (index_commit(index, tmp, out, &bloom, err)) {
+		ret = -1;
+		goto out;
+	}
+	psys_free(tmp);
+	tmp = NULL;
+
+	ret = 0;
+out:
+	if (out)
+		fclose(out);
+	if (tmp) {
+		unlink(tmp);
+		psys_free(tmp);
+	}
+	if (map)
+		munmap(map, size);
+	psys_free(bloom.bits);
+	return ret;
+}
+
+int psys_index_update(const char *index, const char *vendor,
+		      const char *name, psys_flist_t files, psys_err_t *err)
+{
+	struct index_entry *entries = NULL;
+	char *owner = NULL;
+	size_t owner_len, n;
+	int ret;
+	psys_flist_t f;
+
+	assert(index != NULL);
+	assert(vendor != NULL);
+	assert(name != NULL);
+
+	if (psys_asprintf(&owner, "%s\t%s", vendor, name) < 0) {
+		owner = NULL;
+		psys_err_set_nomem(err);
+		ret = -1;
+		goto out;
+	}
+	owner_len = strlen(owner);
+
+	/* Sort the package's new entries */
+	n = 0;
+	for (f = files; f; f = psys_flist_next(f))
+		n++;
+	if (n) {
+		entries = psys_malloc(n * sizeof(*entries));
+		if (!entries) {
+			psys_err_set_nomem(err);
+			ret = -1;
+			goto out;
+		}
+	}
+
+	n = 0;
+	for (f = files; f; f = psys_flist_next(f)) {
+		if (strpbrk(f->path, "\t\n"))
+			continue;
+		entries[n].path = f->path;
+		entries[n].path_len = strlen(f->path);
+		entries[n].owner = owner;
+		entries[n].owner_len = owner_len;
+		n++;
+	}
+	qsort(entries, n, sizeof(*entries), index_entry_cmp);
+
+	ret = index_rewrite(index, &owner, 1, entries, n, err);
+out:
+	psys_free(entries);
+	psys_free(owner);
+	return ret;
+}
+
+int psys_index_remove(const char *index, const char * const *vendors,
+		      const char * const *names, size_t count,
+		      psys_err_t *err)
+{
+	char **owners;
+	size_t i;
+	int ret;
+
+	assert(index != NULL);
+	assert(vendors != NULL || count == 0);
+	assert(names != NULL || count == 0);
+
+	owners = psys_calloc(count ? count : 1, sizeof(*owners));
+	if (!owners) {
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (psys_asprintf(&owners[i], "%s\t%s", vendors[i],
+				  names[i]) < 0) {
+			owners[i] = NULL;
+			psys_err_set_nomem(err);
+			ret = -1;
+			goto out;
+		}
+	}
+	qsort(owners, count, sizeof(*owners), owner_cmp);
+
+	ret = index_rewrite(index, owners, count, NULL, 0, err);
+out:
+	for (i = 0; i < count; i++)
+		psys_free(owners[i]);
+	psys_free(owners);
+	return ret;
+}
+
+/*
+ * An index builder collects the entries of all packages in memory, so that
+ * an index can be created from scratch with a single write
+ */
+struct _psys_index_builder {
+	struct index_entry *entries;
+	size_t n;
+	size_t max;
+
+	/* Blocks holding the entries' strings, one per package */
+	char **blocks;
+	size_t nblocks;
+	size_t max_blocks;
+};
+
+psys_index_builder_t psys_index_builder_new(psys_err_t *err)
+{
+	psys_index_builder_t b;
+
+	b = psys_calloc(1, sizeof(*b));
+	if (!b)
+		psys_err_set_nomem(err);
+	return b;
+}
+
+int psys_index_builder_add(psys_index_builder_t b, const char *vendor,
+			   const char *name, psys_flist_t files,
+			   psys_err_t *err)
+{
+	psys_flist_t f;
+	char *block, *p;
+	size_t owner_len, len, n;
+
+	assert(b != NULL);
+	assert(vendor != NULL);
+	assert(name != NULL);
+
+	/* Copy the owner and all paths into a single block */
+	owner_len = strlen(vendor) + 1 + strlen(name);
+	len = owner_len + 1;
+	n = 0;
+	for (f = files; f; f = psys_flist_next(f)) {
+		if (strpbrk(f->path, "\t\n"))
+			continue;
+		len += strlen(f->path) + 1;
+		n++;
+	}
+
+	if (b->nblocks == b->max_blocks) {
+		size_t max = b->max_blocks ? 2 * b->max_blocks : 64;
+		char **blocks;
+
+		blocks = psys_realloc(b->blocks, max * sizeof(*blocks));
+		if (!blocks)
+			goto nomem;
+		b->blocks = blocks;
+		b->max_blocks = max;
+	}
+	if (b->n + n > b->max) {
+		size_t max = b->max ? 2 * b->max : 1024;
+		struct index_entry *entries;
+
+		while (max < b->n + n)
+			max *= 2;
+		entries = psys_realloc(b->entries, max * sizeof(*entries));
+		if (!entries)
+			goto nomem;
+		b->entries = entries;
+		b->max = max;
+	}
+
+	block = psys_malloc(len);
+	if (!block)
+		goto nomem;
+	b->blocks[b->nblocks++] = block;
+
+	sprintf(block, "%s\t%s", vendor, name);
+	p = block + owner_len + 1;
+	for (f = files; f; f = psys_flist_next(f)) {
+		struct index_entry *e;
+
+		if (strpbrk(f->path, "\t\n"))
+			continue;
+
+		e = &b->entries[b->n++];
+		e->path = p;
+		e->path_len = strlen(f->path);
+		e->owner = block;
+		e->owner_len = owner_len;
+
+		memcpy(p, f->path, e->path_len + 1);
+		p += e->path_len + 1;
+	}
+	return 0;
+
+nomem:
+	psys_err_set_nomem(err);
+	return -1;
+}
+
+int psys_index_builder_save(psys_index_builder_t b, const char *index,
+			    psys_err_t *err)
+{
+	struct bloom bloom = {NULL, 0};
+	char *tmp = NULL;
+	FILE *out = NULL;
+	size_t i;
+	int ret;
+
+	assert(b != NULL);
+	assert(index != NULL);
+
+	if (b->n)
+		qsort(b->entries, b->n, sizeof(*b->entries), index_entry_cmp);
+
+	if (bloom_init(&bloom, b->n)) {
+		psys_err_set_nomem(err);
+		ret = -1;
+		goto out;
+	}
+
+	out = tmp_create(index, &tmp, err);
+	if (!out) {
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < b->n; i++) {
+		if (!i || index_entry_cmp(&b->entries[i], &b->entries[i - 1]))
+			index_write(out, &bloom, &b->entries[i]);
+	}
+
+	if (index_commit(index, tmp, out, &bloom, err)) {
+		ret = -1;
+		goto out;
+	}
+	psys_free(tmp);
+	tmp = NULL;
+
+	ret = 0;
+out:
+	if (out)
+		fclose(out);
+	if (tmp) {
+		unlink(tmp);
+		psys_free(tmp);
+	}
+	psys_free(bloom.bits);
+	return ret;
+}
+
+void psys_index_builder_free(psys_index_builder_t b)
+{
+	size_t i;
+
+	if (b) {
+		for (i = 0; i < b->nblocks; i++)
+			psys_free(b->blocks[i]);
+		psys_free(b->blocks);
+		psys_free(b->entries);
+		psys_free(b);
+	}
+}
+
+int psys_index_build_filter(const char *index, psys_err_t *err)
+{
+	struct bloom bloom;
+	struct index_entry e;
+	struct stat st;
+	const char *p, *end;
+	void *map;
+	size_t size;
+	int ret;
+
+	assert(index != NULL);
+
+	if (index_map(index, &map, &size, &st, err))
+		return -1;
+
+	if (bloom_init(&bloom, index_count(map, size))) {
+		if (map)
+			munmap(map, size);
+		psys_err_set_nomem(err);
+		return -1;
+	}
+
+	end = (const char *) map + size;
+	for (p = map; p < end; ) {
+		p = index_parse(p, end, &e);
+		bloom_add(&bloom, e.path, e.path_len);
+	}
+
+	ret = bloom_save(&bloom, index, &st, err);
+	psys_free(bloom.bits);
+	if (map)
+		munmap(map, size);
+	return ret;
+}
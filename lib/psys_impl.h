@@ -32,6 +32,49 @@
 /* File list type */
 typedef struct _psys_flist *psys_flist_t;
 
+/* Owner index type */
+typedef struct _psys_index *psys_index_t;
+
+/* Owner index builder type */
+typedef struct _psys_index_builder *psys_index_builder_t;
+
+/* Owner index lookup callback type */
+typedef int (*psys_index_fn)(const char *vendor, const char *name,
+			     void *data);
+
+/* Span of the trace enabled with PSYS_TRACE (see psys_span_begin()) */
+struct psys_span {
+	const char *name;
+	unsigned long long start;
+};
+
+/* Phase timer for psys_phase_begin() and psys_phase_end() */
+struct psys_phase {
+	psys_stats_t stats;
+	int phase;
+	struct timespec wall;
+	struct timespec cpu;
+	struct psys_span span;
+};
+
+/* Recording statistics for the statistics object attached to the thread */
+extern void psys_phase_begin(struct psys_phase *p, int phase);
+extern void psys_phase_end(struct psys_phase *p);
+extern void psys_stats_add(int counter, unsigned long long n);
+
+/* Tracing operations */
+extern void psys_span_begin(struct psys_span *s, const char *name);
+extern void psys_span_end(struct psys_span *s);
+
+/* Allocating memory with the allocator set by psys_set_allocator() */
+extern void *psys_malloc(size_t size);
+extern void *psys_calloc(size_t nmemb, size_t size);
+extern void *psys_realloc(void *ptr, size_t size);
+extern void psys_free(void *ptr);
+extern char *psys_strdup(const char *str);
+extern char *psys_strndup(const char *str, size_t len);
+extern int psys_asprintf(char **strp, const char *format, ...);
+
 /* Looking up the system's LSB distributor ID */
 extern char *psys_lsb_distributor_id(void);
 
@@ -43,6 +86,9 @@ extern void psys_pkg_assert_valid(psys_pkg_t pkg);
 extern int psys_pkg_vercmp(psys_pkg_t, const char *version);
 extern int psys_pkg_lsbvercmp(psys_pkg_t, const char *lsbversion);
 
+/* Looking up default translations */
+extern const char *psys_tlist_default(psys_tlist_t list);
+
 /* Setting errors */
 extern void psys_err_set(psys_err_t *err, int code, const char *format, ...);
 extern void psys_err_set_nomem(psys_err_t *err);
@@ -56,10 +102,42 @@ extern const char *psys_flist_path(psys_flist_t file);
 extern const struct stat *psys_flist_stat(psys_flist_t file);
 extern psys_flist_t psys_flist_next(psys_flist_t file);
 
+/* Building file lists from package database records */
+extern psys_flist_t psys_flist_prepend(psys_flist_t list, const char *path,
+				       const struct stat *st,
+				       const char *md5);
+
 /* Freeing file lists */
 extern void psys_flist_free(psys_flist_t list);
 
 /* Calculating MD5 sums */
-char *psys_flist_md5sum(psys_flist_t file, psys_err_t *err);
+extern int psys_flist_md5sums(psys_flist_t list, psys_err_t *err);
+extern char *psys_flist_md5sum(psys_flist_t file, psys_err_t *err);
+
+/* Verifying package files */
+extern int psys_flist_verify(psys_flist_t list, int mode, psys_verify_fn fn,
+			     void *data, psys_err_t *err);
+
+/* Indexing package file owners */
+extern psys_index_t psys_index_open(const char *index, psys_err_t *err);
+extern int psys_index_find(psys_index_t idx, const char *path,
+			   psys_index_fn fn, void *data, psys_err_t *err);
+extern void psys_index_close(psys_index_t idx);
+extern int psys_index_lookup(const char *index, const char *path,
+			     psys_index_fn fn, void *data, psys_err_t *err);
+extern int psys_index_update(const char *index, const char *vendor,
+			     const char *name, psys_flist_t files,
+			     psys_err_t *err);
+extern int psys_index_remove(const char *index, const char * const *vendors,
+			     const char * const *names, size_t count,
+			     psys_err_t *err);
+extern psys_index_builder_t psys_index_builder_new(psys_err_t *err);
+extern int psys_index_builder_add(psys_index_builder_t b, const char *vendor,
+				  const char *name, psys_flist_t files,
+				  psys_err_t *err);
+extern int psys_index_builder_save(psys_index_builder_t b, const char *index,
+				   psys_err_t *err);
+extern void psys_index_builder_free(psys_index_builder_t b);
+extern int psys_index_build_filter(const char *index, psys_err_t *err);
 
 #endif
@@ -0,0 +1,44 @@
+/*
+ * libpsys - Linux package manager interaction library
+ *
+ * Copyright (C) 2010  Denis Washington <dwashington@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+
+/*
+ * psys_md5.h - MD5 message digest (RFC 1321)
+ */
+
+#ifndef _PSYS_MD5_H
+#define _PSYS_MD5_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct psys_md5 {
+	uint32_t state[4];
+	uint64_t count;
+	unsigned char buf[64];
+};
+
+extern void psys_md5_init(struct psys_md5 *ctx);
+extern void psys_md5_update(struct psys_md5 *ctx, const void *data,
+			    size_t len);
+extern void psys_md5_final(struct psys_md5 *ctx, unsigned char digest[16]);
+
+#endif /* _PSYS_MD5_H */
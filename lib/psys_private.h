@@ -23,7 +23,6 @@
  * psys_private.h - Private helper functions
  */
 
-#include <limits.h>
 #include <string.h>
 
 #include "psys.h"
@@ -32,25 +31,71 @@
 struct _psys_err {
 	int code;
 	char *msg;
+
+	/* Not allocated for the caller (and thus never freed) */
+	int shared;
 };
 
 /*** Validating paths *********************************************************/
 
-static int psys_path_is_canonical(const char *path)
+/*
+ * Checks whether path is canonical, that is, absolute and without empty,
+ * "." or ".." components (so without repeated or trailing slashes
+ * either). If it is, returns 1 and stores the length of the path in
+ * *len unless len is NULL; otherwise, returns 0.
+ *
+ * This is done in a single pass over the path without copying it. The
+ * components are found with strchr(), which is vectorized in common C
+ * libraries and thus fast even for long paths.
+ */
+static inline int psys_path_scan(const char *path, size_t *len)
 {
-	char pathcpy[PATH_MAX];
-	char *run, *cmp;
-
-	/*
-	 * Don't copy the initial '/' to avoid the first token returned by
-	 * strsep() being an empty string.
-	 */
-	strncpy(pathcpy, path + 1, PATH_MAX);
-
-	run = pathcpy;
-	while ((cmp = strsep(&run, "/")) != NULL) {
-		if (!strlen(cmp) || !strcmp(cmp, ".") || !strcmp(cmp, ".."))
+	const char *c, *end;
+
+	if (path[0] != '/')
+		return 0;
+
+	for (c = path + 1; ; c = end + 1) {
+		end = strchr(c, '/');
+		if (!end)
+			end = c + strlen(c);
+
+		if (end == c)
+			return 0;
+		if (c[0] == '.' && (end - c == 1 ||
+				    (end - c == 2 && c[1] == '.')))
 			return 0;
+		if (!*end)
+			break;
 	}
+
+	if (len)
+		*len = end - path;
 	return 1;
 }
+
+static inline int psys_path_is_canonical(const char *path)
+{
+	return psys_path_scan(path, NULL);
+}
+
+/*** Encoding version keys ****************************************************/
+
+/*
+ * A version key is a binary encoding of a package version which compares
+ * like the version itself under psys_verkey_cmp(), according to the rules
+ * in psysmeta(7). Package objects keep the key of their version so that
+ * it only needs to be computed once.
+ */
+
+/* Upper bound for the key length of a version of the given length */
+#define PSYS_VERKEY_MAX(len) (2 * (len) + 3)
+
+/* Implemented in psys_impl.c */
+extern size_t psys_verkey_encode(const char *version, unsigned char *key,
+				 size_t size);
+extern int psys_verkey_cmp(const unsigned char *key1, size_t len1,
+			   const unsigned char *key2, size_t len2);
+
+/* Implemented in psys.c */
+extern const unsigned char *psys_pkg_verkey(psys_pkg_t pkg, size_t *len);
@@ -0,0 +1,53 @@
+/*
+ * libpsys - Linux package manager interaction library
+ *
+ * Copyright (C) 2010  Denis Washington <dwashington@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+/*
+ * psys_probes.h - USDT probes for tracing the psys library with tools like
+ * bpftrace, perf and SystemTap
+ *
+ * The probes are only compiled in if <sys/sdt.h> was found by configure.
+ * Otherwise, the macros expand to nothing and their arguments are not
+ * evaluated. See psys(7) for the list of probes.
+ */
+
+#ifndef _PSYS_PROBES_H
+#define _PSYS_PROBES_H
+
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define PSYS_PROBE1(name, a1) \
+	DTRACE_PROBE1(psys, name, a1)
+#define PSYS_PROBE2(name, a1, a2) \
+	DTRACE_PROBE2(psys, name, a1, a2)
+#define PSYS_PROBE3(name, a1, a2, a3) \
+	DTRACE_PROBE3(psys, name, a1, a2, a3)
+
+#else
+
+#define PSYS_PROBE1(name, a1) do { } while (0)
+#define PSYS_PROBE2(name, a1, a2) do { } while (0)
+#define PSYS_PROBE3(name, a1, a2, a3) do { } while (0)
+
+#endif /* HAVE_SYS_SDT_H */
+
+#endif /* _PSYS_PROBES_H */
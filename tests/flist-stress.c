@@ -0,0 +1,374 @@
+/*
+ * libpsys - Linux package manager interaction library
+ *
+ * Copyright (C) 2010  Denis Washington <dwashington@gmx.net>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA  02110-1301  USA
+ */
+
+/*
+ * Stress test for psys_pkg_flist(): builds the file lists of N packages
+ * from N threads at once, many times over, and checks each list against
+ * the files created for its package.
+ *
+ * The package directories are created in a temporary directory, which is
+ * bind-mounted over /opt in a private mount namespace, so the test needs
+ * no privileges and leaves the real /opt alone. If no mount namespace can
+ * be set up, the test is skipped.
+ *
+ * Usage: flist-stress [NTHREADS [NROUNDS]]
+ */
+
+/* Needed for vasprintf(), unshare() and nftw() */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <psys.h>
+#include <psys_impl.h>
+
+/* Exit status telling automake's test driver that the test was skipped */
+#define EXIT_SKIP 77
+
+#define VENDOR "stress.example"
+
+struct pkg_data {
+	psys_pkg_t pkg;
+	int nrounds;
+
+	/* Paths the file list must contain, sorted */
+	char **paths;
+	size_t npaths;
+
+	pthread_t thread;
+	char *error;
+};
+
+static char root[] = "/tmp/psys-flist-stress.XXXXXX";
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+/* asprintf() which exits on failure */
+static char *format(const char *fmt, ...)
+{
+	va_list ap;
+	char *s;
+	int rc;
+
+	va_start(ap, fmt);
+	rc = vasprintf(&s, fmt, ap);
+	va_end(ap);
+	if (rc < 0)
+		die("asprintf()");
+	return s;
+}
+
+static int pathcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+static void expect(struct pkg_data *pd, const char *path)
+{
+	pd->paths = realloc(pd->paths, (pd->npaths + 1) * sizeof(*pd->paths));
+	if (!pd->paths || !(pd->paths[pd->npaths] = strdup(path)))
+		die("malloc()");
+	pd->npaths++;
+}
+
+static void create_file(const char *path, const char *content)
+{
+	FILE *f;
+
+	f = fopen(path, "w");
+	if (!f)
+		die(path);
+	fputs(content, f);
+	fclose(f);
+}
+
+/*
+ * Creates the file `rel' of package number i in the stand-in /opt and
+ * records it as a file of the package. If `rel' is empty or ends with a
+ * slash, a directory is created.
+ */
+static void create(struct pkg_data *pd, int i, const char *rel)
+{
+	char *path, *opt_path;
+	size_t len;
+
+	path = format("%s/opt/" VENDOR "/pkg%d/%s", root, i, rel);
+	opt_path = format("/opt/" VENDOR "/pkg%d/%s", i, rel);
+
+	len = strlen(path);
+	if (path[len - 1] == '/') {
+		path[len - 1] = '\0';
+		opt_path[strlen(opt_path) - 1] = '\0';
+		if (mkdir(path, 0755))
+			die(path);
+	} else {
+		create_file(path, opt_path);
+	}
+
+	expect(pd, opt_path);
+	free(opt_path);
+	free(path);
+}
+
+/* Sets up the files of package number i */
+static void setup_package(struct pkg_data *pd, int i)
+{
+	char *name, *path;
+	int j;
+	char rel[64];
+
+	name = format("pkg%d", i);
+	pd->pkg = psys_pkg_new(VENDOR, name, "1.0", "3.0", "noarch");
+	if (!pd->pkg)
+		die("psys_pkg_new()");
+	free(name);
+
+	create(pd, i, "");
+	create(pd, i, "bin/");
+	create(pd, i, "lib/");
+	create(pd, i, "share/");
+	create(pd, i, "share/doc/");
+	create(pd, i, "share/doc/README");
+
+	/* Give the packages different sizes */
+	for (j = 0; j < 10 * (i % 5 + 1); j++) {
+		snprintf(rel, sizeof(rel), "bin/tool%d", j);
+		create(pd, i, rel);
+	}
+	for (j = 0; j < 3; j++) {
+		snprintf(rel, sizeof(rel), "lib/lib%d.so", j);
+		create(pd, i, rel);
+	}
+
+	/* Symbolic links are listed, not followed */
+	path = format("%s/opt/" VENDOR "/pkg%d/lib/current", root, i);
+	if (symlink("lib0.so", path))
+		die(path);
+	free(path);
+	path = format("/opt/" VENDOR "/pkg%d/lib/current", i);
+	expect(pd, path);
+	free(path);
+
+	/* An existing and a missing extra file */
+	path = format("%s/extras/pkg%d.conf", root, i);
+	if (psys_pkg_add_extra(pd->pkg, path))
+		die("psys_pkg_add_extra()");
+	create_file(path, "");
+	expect(pd, path);
+	free(path);
+
+	path = format("%s/extras/pkg%d.missing", root, i);
+	if (psys_pkg_add_extra(pd->pkg, path))
+		die("psys_pkg_add_extra()");
+	free(path);
+
+	qsort(pd->paths, pd->npaths, sizeof(*pd->paths), pathcmp);
+}
+
+/* Returns a description of how `files' differs from the expected list */
+static char *check_flist(struct pkg_data *pd, psys_flist_t files)
+{
+	const char **paths;
+	char *error = NULL;
+	psys_flist_t f;
+	size_t n, i;
+
+	n = 0;
+	for (f = files; f; f = psys_flist_next(f))
+		n++;
+	paths = malloc((n ? n : 1) * sizeof(*paths));
+	if (!paths)
+		die("malloc()");
+
+	i = 0;
+	for (f = files; f; f = psys_flist_next(f)) {
+		if (!psys_flist_stat(f)) {
+			error = format("no status for `%s'",
+				       psys_flist_path(f));
+			goto out;
+		}
+		paths[i++] = psys_flist_path(f);
+	}
+	qsort(paths, n, sizeof(*paths), pathcmp);
+
+	if (n != pd->npaths) {
+		error = format("%zu files listed, %zu expected", n,
+			       pd->npaths);
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (strcmp(paths[i], pd->paths[i])) {
+			error = format("`%s' listed, `%s' expected",
+				       paths[i], pd->paths[i]);
+			goto out;
+		}
+	}
+
+out:
+	free(paths);
+	return error;
+}
+
+static void *thread_fn(void *data)
+{
+	struct pkg_data *pd = data;
+	int round;
+
+	for (round = 0; round < pd->nrounds && !pd->error; round++) {
+		psys_err_t err = NULL;
+		psys_flist_t files;
+
+		files = psys_pkg_flist(pd->pkg, &err);
+		if (!files) {
+			pd->error = format("psys_pkg_flist(): %s",
+					   psys_err_msg(err));
+			psys_err_free(err);
+			break;
+		}
+
+		pd->error = check_flist(pd, files);
+		psys_flist_free(files);
+	}
+
+	return NULL;
+}
+
+/*
+ * Enters a private mount namespace with `root'/opt mounted over /opt.
+ * Unprivileged processes need a user namespace for that.
+ */
+static int enter_namespace(void)
+{
+	char opt[PATH_MAX];
+
+	if (unshare(CLONE_NEWNS) &&
+	    (errno != EPERM || unshare(CLONE_NEWUSER | CLONE_NEWNS)))
+		return -1;
+	if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL))
+		return -1;
+
+	snprintf(opt, sizeof(opt), "%s/opt", root);
+	return mount(opt, "/opt", NULL, MS_BIND, NULL);
+}
+
+static int remove_fn(const char *path, const struct stat *st, int flag,
+		     struct FTW *ftw)
+{
+	return remove(path);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pkg_data *pkgs;
+	int nthreads = 16;
+	int nrounds = 50;
+	int failed = 0;
+	char *path;
+	int i;
+
+	if (argc > 1)
+		nthreads = atoi(argv[1]);
+	if (argc > 2)
+		nrounds = atoi(argv[2]);
+	if (nthreads < 1 || nrounds < 1) {
+		fprintf(stderr, "Usage: %s [NTHREADS [NROUNDS]]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	pkgs = calloc(nthreads, sizeof(*pkgs));
+	if (!pkgs)
+		die("malloc()");
+
+	/* Set up the stand-in /opt and the extra files */
+	if (!mkdtemp(root))
+		die("mkdtemp()");
+	path = format("%s/opt", root);
+	if (mkdir(path, 0755))
+		die(path);
+	free(path);
+	path = format("%s/opt/" VENDOR, root);
+	if (mkdir(path, 0755))
+		die(path);
+	free(path);
+	path = format("%s/extras", root);
+	if (mkdir(path, 0755))
+		die(path);
+	free(path);
+
+	for (i = 0; i < nthreads; i++) {
+		pkgs[i].nrounds = nrounds;
+		setup_package(&pkgs[i], i);
+	}
+
+	if (enter_namespace()) {
+		fprintf(stderr, "Cannot mount a stand-in /opt (%s); "
+			"skipping the test\n", strerror(errno));
+		nftw(root, remove_fn, 16, FTW_DEPTH | FTW_PHYS);
+		return EXIT_SKIP;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&pkgs[i].thread, NULL, thread_fn, &pkgs[i]))
+			die("pthread_create()");
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(pkgs[i].thread, NULL);
+		if (pkgs[i].error) {
+			fprintf(stderr, "%s/%s: %s\n",
+				psys_pkg_vendor(pkgs[i].pkg),
+				psys_pkg_name(pkgs[i].pkg), pkgs[i].error);
+			failed = 1;
+		}
+	}
+
+	printf("%d packages listed %d times each from %d threads: %s\n",
+	       nthreads, nrounds, nthreads, failed ? "FAILED" : "ok");
+
+	nftw(root, remove_fn, 16, FTW_DEPTH | FTW_PHYS);
+	for (i = 0; i < nthreads; i++) {
+		size_t j;
+
+		for (j = 0; j < pkgs[i].npaths; j++)
+			free(pkgs[i].paths[j]);
+		free(pkgs[i].paths);
+		free(pkgs[i].error);
+		psys_pkg_free(pkgs[i].pkg);
+	}
+	free(pkgs);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}